@@ -0,0 +1,171 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+#include "brdf.hpp"
+#include "geometry.hpp"
+#include "mesh.hpp"
+#include "storage.hpp"
+#include "triangleBlocks.hpp"
+
+#include <glm/glm.hpp>
+#include <cfloat>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+class CacheFile;
+class Model;
+class Mesh;
+class Scene;
+class Vertex;
+
+// Shared by all triangles of the meshes using it
+struct Material {
+    const BRDFT BRDFtype;
+
+    // colours
+    const glm::vec3 Kd;
+    const glm::vec3 Ke;
+
+    // textures
+    Texture *texDiffuse;
+
+    // mesh it was found in first, the texture is taken from it again when loading from the cache
+    const id_t mesh;
+};
+
+// What a hit needs of its triangle, 16 bytes
+struct TriangleShading {
+    glm::vec3 normal;
+    id_t material;
+};
+
+// texture coords, only looked up for textured materials
+struct TriangleTexCoords {
+    glm::vec2 texFst, texSnd, texTrd;
+};
+
+/* Ray with what traversal needs computed once: the inverse direction turns distances to planes into multiplications
+ * and its sign bits tell which side of a plane or box the ray meets first. Only hits in [tnear, tfar] count. */
+struct Ray {
+    Ray() = default;
+    Ray(const glm::vec3 &origin, const glm::vec3 &dir, float tnear = 0.f, float tfar = FLT_MAX);
+    // 1 / d, where zero is taken as the smallest normal float of its sign, so a ray parallel to a plane gets huge or
+    // infinite distances to it but never NaN
+    static float inverse(float d) { return 1.f / (d != 0.f ? d : std::copysign(FLT_MIN, d)); }
+
+    glm::vec3 origin;
+    glm::vec3 dir;
+    glm::vec3 invDir;
+    // 1 where the direction is negative, the ray then enters boxes through their maximal sides
+    id_t sign[3];
+    float tnear;
+    float tfar;
+};
+
+// Rays sharing their origin, like primary rays of a pinhole camera, traced through the structure together
+struct RayPacket {
+    static constexpr unsigned size = 16;
+    // rays in use, the rest of the arrays is ignored
+    unsigned count;
+    glm::vec3 origin;
+    glm::vec3 dir[size];
+    // results, as intersectRay gives them
+    bool hit[size];
+    id_t triangle[size];
+    glm::vec2 baryPosition[size];
+    float distance[size];
+};
+
+// Enum for choosing the acceleration structure in the rtc file
+enum class AcceleratorT { KDTree, BVH, BVH4, BVH8, TwoLevel, OutOfCore };
+
+// How binary BVHs, which wide ones are collapsed from, are built: binned SAH splits, or ranges of triangles sorted
+// along a Morton curve, much faster to build and somewhat slower to trace
+enum class BVHBuilder { SAH, LBVH };
+
+/* Triangles of the model in world space together with a structure speeding up rays intersecting them. */
+class Accelerator {
+  public:
+    // Build the structure chosen in scene, or map it from the cache file next to the model when it was built before
+    static std::unique_ptr<Accelerator> create(Model &model, Scene &scene);
+
+    // Triangles of all instances of the model in world space
+    Accelerator(Model &model, Scene &scene);
+    // Triangles of a single mesh in its own space, no lights are looked for
+    Accelerator(const Mesh &mesh, Scene &scene);
+    // Triangles of source by their ids, in that order, with shading pointing into the materials of source
+    Accelerator(const Accelerator &source, const std::vector<id_t> &ids, Scene &scene);
+    // Nothing is built, everything comes from the cache
+    explicit Accelerator(Scene &scene);
+    virtual ~Accelerator();
+
+    // Closest hit along the ray, as a triangle with barycentric position of the hit and distance to it.
+    virtual bool intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) = 0;
+
+    // Closest hits of all rays in the packet, one by one unless the structure knows better.
+    virtual void intersectPacket(RayPacket &packet);
+
+    // Is there anything but lightTriangle closer than tfar along the ray.
+    virtual bool intersectShadowRay(const Ray &ray, const id_t lightTriangle) = 0;
+
+    // Bytes used by the structure itself, triangles and materials are not counted.
+    virtual size_t memoryUsage() = 0;
+
+    // Saves the structure to the cache or, once it is loaded, maps it from there. Subclasses add their nodes.
+    virtual void serialize(CacheFile &cache);
+
+    // Moves the triangles to where the model's instances are now and fits the boxes to them bottom-up, keeping the
+    // topology. False when the structure can't do that, it has to be built again then.
+    virtual bool refit(Model &, Scene &) { return false; }
+    // Expected cost of a ray by the surface area heuristic, which grows as refitted boxes get loose. 0 if unknown.
+    virtual float sahCost() const { return 0.f; }
+
+    // Triangle, its normal, material and texture coordinates in world space by the id intersectRay gives, structures
+    // not keeping them so override it. Each reads a separate array, so the hit path only touches what it needs.
+    virtual Triangle triangle(id_t id) const { return triangles[id]; }
+    virtual glm::vec3 normal(id_t id) const { return shading[id].normal; }
+    virtual const Material &material(id_t id) const { return materials[shading[id].material]; }
+    virtual TriangleTexCoords texCoords(id_t id) const { return triangleTexCoords[id]; }
+    virtual size_t triangleCount() const { return triangles.size(); }
+
+    // Point, normal and BRDF of the triangle at barycentric position, its texture looked up when it has one.
+    void surfaceAt(id_t triangleID, glm::vec2 baryPos, glm::vec3 &intersection, glm::vec3 &normal, BRDF &brdf) const;
+
+    Geometry triangles;
+    Storage<TriangleShading> shading;
+    Storage<TriangleTexCoords> triangleTexCoords;
+    // distinct materials of the meshes, in the order they were found
+    Storage<Material> materials;
+    glm::vec3 minCoords;
+    glm::vec3 maxCoords;
+
+  protected:
+    // Points the mapped materials at the model's textures and finds the lights again, false if the model differs.
+    virtual bool linkModel(Model &model, Scene &scene);
+    // Adds triangles of emissive meshes to the scene's lights, ids go instance by instance as the model lists them.
+    void findLights(Model &model, Scene &scene) const;
+    // Extracts triangles of all instances again where they are now and finds the lights on them, keeping their order.
+    // False if the model has a different number of triangles.
+    bool moveTriangles(Model &model, Scene &scene);
+
+    // triangles of all leaves in the format chosen in scene
+    TriangleBlocks blocks;
+    // seconds the constructor took to extract triangles and materials from the model
+    float extractTime = 0.f;
+
+  private:
+    // Appends triangles of the mesh moved to world space by transform and their materials, growing the bounds.
+    void addMesh(const Mesh &mesh, id_t meshIndex, const glm::mat4 &transform);
+    // Index of the mesh's material, added to materials unless an equal one is there.
+    id_t addMaterial(const Mesh &mesh, id_t meshIndex);
+    // where mapped arrays live, kept as long as the structure
+    std::unique_ptr<CacheFile> cache;
+};
+
+// Normal moved to world space by the inverse transpose of the object's transformation, keeping its length.
+glm::vec3 transformNormal(const glm::mat3 &normalTransform, const glm::vec3 &normal);
+
+// Distances along the ray to where it enters and leaves the box.
+std::pair<float, float> intersectRayBox(const Ray &ray, const glm::vec3 &max, const glm::vec3 &min);
+
+#endif // ACCELERATOR_H
@@ -4,40 +4,30 @@
 
 #include <glm/glm.hpp>
 
-// Enum for helping with dynamic allocation of BRDF materials
+// Kinds of BRDF materials
 enum class BRDFT { Diffuse, Emissive };
 
-// The interface for any BRDF.
-class BRDF {
-  public:
+/* BRDF of a surface point, a value made on the stack for every hit. The kind is dispatched by a switch, so a bounce
+ * neither allocates nor calls anything virtually. */
+struct BRDF {
+    BRDFT type;
+    glm::vec3 color;
+    // light emitted by Emissive ones
+    glm::vec3 radianceColor;
+
+    // A Lambertian (diffuse) material
+    static BRDF diffuse(const glm::vec3 &color) { return {BRDFT::Diffuse, color, glm::vec3(0.f)}; }
+    // Diffuse material emitting radiance
+    static BRDF emissive(const glm::vec3 &color, const glm::vec3 &radiance) {
+        return {BRDFT::Emissive, color, radiance};
+    }
+
     // Return the value of the brdf for specific directions
-    virtual glm::vec3 f(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n) = 0;
+    glm::vec3 f(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n) const;
 
     // Sample a suitable direction and return the brdf in that direction as
     // well as the pdf (~probability) that the direction was chosen.
-    virtual glm::vec3 sample_wi(glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n, float &pdf) = 0;
-
-    virtual glm::vec3 radiance();
+    glm::vec3 sample_wi(glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n, float &pdf) const;
 
-    virtual ~BRDF();
+    glm::vec3 radiance() const;
 };
-
-// A Lambertian (diffuse) material
-class Diffuse : public BRDF {
-  public:
-    glm::vec3 color;
-    Diffuse(glm::vec3 c) : color(c) {}
-    virtual glm::vec3 f(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n) override;
-    virtual glm::vec3 sample_wi(glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n, float &pdf) override;
-
-    virtual ~Diffuse();
-};
-
-// Emissive material
-class Emissive : public Diffuse {
-  public:
-    glm::vec3 radianceColor;
-    Emissive(glm::vec3 c, glm::vec3 r) : Diffuse(c), radianceColor(r) {}
-    virtual glm::vec3 radiance() override;
-    virtual ~Emissive();
-};
\ No newline at end of file
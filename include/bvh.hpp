@@ -0,0 +1,71 @@
+#ifndef BVH_H
+#define BVH_H
+#include "accelerator.hpp"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+/* Bounding volume hierarchy split by binned SAH over triangle centroids, or over ranges of triangles sorted along a
+ * Morton curve, each triangle lands in exactly one leaf. */
+class BVH : public Accelerator {
+  public:
+    // SAH cost of testing a ray against a node's box and against a single triangle
+    static constexpr float traversalCost = 1.f;
+    static constexpr float intersectionCost = 2.f;
+    // candidate splits per axis are the boundaries between centroid bins
+    static constexpr unsigned binCount = 16;
+    // leaves bigger than that are split even when the SAH says otherwise
+    static constexpr unsigned maxLeafSize = 16;
+    // nodes waiting during traversal
+    static constexpr unsigned stackSize = 64;
+    // leaves of a subtree the linear builder rearranges at once
+    static constexpr unsigned treeletSize = 7;
+
+    BVH(Model &model, Scene &scene);
+    // tree over a single mesh in its own space
+    BVH(const Mesh &mesh, Scene &scene);
+    // tree over a part of the triangles of source
+    BVH(const Accelerator &source, const std::vector<id_t> &ids, Scene &scene);
+    explicit BVH(Scene &scene);
+    bool intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) override;
+    bool intersectShadowRay(const Ray &ray, const id_t lightTriangle) override;
+    size_t memoryUsage() override;
+    void serialize(CacheFile &cache) override;
+    bool refit(Model &model, Scene &scene) override;
+    float sahCost() const override;
+
+    // 32 bytes, left child of a node directly follows it
+    struct BVHNode {
+        glm::vec3 min;
+        // node: index of the right child; leaf: first of its triangle blocks
+        id_t offset;
+        glm::vec3 max;
+        // number of triangles in a leaf, 0 for nodes
+        id_t count;
+    };
+    static_assert(sizeof(BVHNode) == 32, "BVH nodes are expected to take 32 bytes");
+
+  protected:
+    // Fits boxes of all nodes to the triangles of their blocks.
+    virtual void refitNodes();
+    Storage<BVHNode> nodes;
+
+  private:
+    // Builds the tree over all triangles, the way the scene asks for, and packs its leaves.
+    void buildTree(const Scene &scene);
+    // box and centroid of every triangle, only needed while building
+    struct BuildTriangle {
+        glm::vec3 min;
+        glm::vec3 max;
+        glm::vec3 centroid;
+    };
+    id_t build(std::vector<BuildTriangle> &bounds, size_t begin, size_t end, unsigned depth);
+    // Splits triangles sorted by Morton codes of their centroids where the codes start to differ.
+    void buildLinear(const std::vector<BuildTriangle> &bounds, bool restructure);
+    template <typename LeafTest>
+    bool traverse(const Ray &ray, const float &tmax, LeafTest leafTest);
+    // triangles of all leaves while building, each leaf owns a contiguous range
+    std::vector<id_t> leafTriangles;
+};
+
+#endif // BVH_H
@@ -0,0 +1,91 @@
+#ifndef CACHEFILE_H
+#define CACHEFILE_H
+#include "storage.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class Scene;
+
+/* Built acceleration structure kept next to the model, so that a scene is built only once. The file is a header
+ * followed by arrays aligned to 64 bytes, which are used in place from its private memory mapping. */
+class CacheFile {
+  public:
+    // Hash of the model's OBJ and MTL files and of every setting the built structure depends on.
+    static uint64_t key(const Scene &scene);
+
+    // Maps the file at path when it was written with the same key, otherwise starts an empty one to be saved there.
+    CacheFile(const std::string &path, uint64_t key);
+    ~CacheFile();
+    CacheFile(const CacheFile &) = delete;
+    CacheFile &operator=(const CacheFile &) = delete;
+
+    // Was the file mapped, so that contents are read from it instead of written.
+    bool loaded() const { return mapping != nullptr; }
+    // Did everything read so far fit in the file.
+    bool good() const { return !truncated; }
+
+    // Contents are listed in the same order for saving and, once loaded, to read them back.
+    template <typename T> void array(Storage<T> &storage);
+    template <typename T> void value(T &value);
+
+    // Skips to the next page boundary and returns it, so that what follows can be paged in and out on its own.
+    size_t page();
+    // Offset where the next array is read or written.
+    size_t position() const;
+    // Asks the kernel to read mapped bytes in ahead or to drop them, they are read from the file again when used.
+    // Only unpatched contents may be dropped, patches of a private mapping are lost with its pages.
+    void advise(size_t begin, size_t end, bool needed);
+
+    // Forgets the mapped file, when it turned out unusable, so that a rebuilt structure is saved over it instead.
+    void discard();
+    // Writes everything listed so far, returns false when that failed.
+    bool save();
+
+  private:
+    struct Header {
+        char magic[8];
+        uint64_t key;
+        uint64_t size;
+    };
+    static constexpr size_t alignment = 64;
+    // granularity of madvise
+    static constexpr size_t pageSize = 4096;
+    // Skips to the next aligned offset, returns the previous one or nothing when the file is too short.
+    char *read(size_t bytes);
+    void write(const void *bytes, size_t count);
+
+    const std::string path;
+    const uint64_t fileKey;
+    char *mapping = nullptr;
+    size_t mappingSize = 0;
+    size_t offset = 0;
+    bool truncated = false;
+    std::vector<char> contents;
+};
+
+template <typename T> void CacheFile::array(Storage<T> &storage) {
+    uint64_t count = storage.size();
+    value(count);
+    if (!loaded()) {
+        write(storage.data(), count * sizeof(T));
+        return;
+    }
+    char *elements = read(count * sizeof(T));
+    if (elements)
+        storage.view(reinterpret_cast<T *>(elements), count);
+}
+
+template <typename T> void CacheFile::value(T &value) {
+    if (!loaded()) {
+        write(&value, sizeof(T));
+        return;
+    }
+    const char *bytes = read(sizeof(T));
+    if (bytes)
+        std::memcpy(&value, bytes, sizeof(T));
+}
+
+#endif // CACHEFILE_H
@@ -0,0 +1,50 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+#include "storage.hpp"
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <sys/types.h>
+#include <unordered_map>
+
+class CacheFile;
+
+struct Triangle {
+    // world coordinates
+    const glm::vec3 posFst, posSnd, posTrd;
+};
+
+/* Triangles as triples of indices into one array of positions, a position shared by several triangles, of one mesh or
+ * of many, is kept once. Traversal works on packed triangle blocks, triangles are put together from here only for
+ * building, refitting and shading. */
+class Geometry {
+  public:
+    Triangle operator[](id_t id) const {
+        return {positions[indices[3 * id]], positions[indices[3 * id + 1]], positions[indices[3 * id + 2]]};
+    }
+    size_t size() const { return indices.size() / 3; }
+    bool empty() const { return indices.empty(); }
+    size_t positionCount() const { return positions.size(); }
+
+    void reserve(size_t triangleCount);
+    // Index of the position, added unless it is there already.
+    id_t addPosition(const glm::vec3 &position);
+    void addTriangle(id_t fst, id_t snd, id_t trd);
+    // Forgets which positions were added, adding more makes them unique again.
+    void finish();
+    void clear();
+
+    size_t memoryUsage() const;
+    void serialize(CacheFile &cache);
+
+  private:
+    struct PositionHash {
+        size_t operator()(const glm::vec3 &position) const;
+    };
+    Storage<glm::vec3> positions;
+    Storage<uint32_t> indices;
+    // positions added so far, only kept while adding triangles
+    std::unordered_map<glm::vec3, id_t, PositionHash> added;
+};
+
+#endif // GEOMETRY_H
@@ -1,79 +1,92 @@
 #ifndef KDTREE_H
 #define KDTREE_H
-#include "brdf.hpp"
-#include "mesh.hpp"
+#include "accelerator.hpp"
 
 #include <glm/glm.hpp>
-#include <memory>
 #include <vector>
 
-class Model;
-class Mesh;
-class Scene;
-class Vertex;
-
-struct Triangle {
-    // world coordinates
-    const glm::vec3 posFst, posSnd, posTrd;
-};
-
-struct Material {
-    const BRDFT BRDFtype;
-    const glm::vec3 normal;
-
-    // colours
-    const glm::vec3 Kd;
-    const glm::vec3 Ke;
-
-    // textures
-    Texture *texDiffuse;
-
-    // texture coords
-    const glm::vec2 texFst, texSnd, texTrd;
-};
-
-class KDTree {
+class KDTree : public Accelerator {
   public:
+    // candidate planes per axis are the boundaries between bins
+    static constexpr unsigned binCount = 32;
+    // nodes with more triangles are built as parallel tasks, chunks of that many are binned and partitioned in parallel
+    static constexpr size_t parallelBuildSize = 1 << 12;
+    static constexpr size_t parallelChunkSize = 1 << 14;
+    // far children waiting during traversal, more than the depth limit of 8 + 1.3 log2(triangles) ever needs
+    static constexpr unsigned stackSize = 64;
+
+    // leaves bigger than that are split even when the SAH says otherwise
     const size_t leafSize;
+    // SAH cost of stepping through a node and of a single ray-triangle test, from the rtc file
+    const float traversalCost;
+    const float intersectionCost;
+    // part of the cost taken off splits cutting away empty space, whose rays leave the tree early
+    const float emptyBonus;
+    // single rays skip triangles they met in an earlier leaf, packets test them again
+    const bool useMailbox;
     KDTree(Model &model, Scene &scene);
-    bool intersectRay(const glm::vec3 &origin, const glm::vec3 &dir, id_t &triangle, glm::vec2 &baryPosition,
-                      float &distance);
-    bool intersectShadowRay(const glm::vec3 &origin, const glm::vec3 &dir, const float distance,
-                            const id_t lightTriangle);
-    std::vector<Triangle> triangles;
-    std::vector<Material> materials;
-    glm::vec3 minCoords;
-    glm::vec3 maxCoords;
+    explicit KDTree(Scene &scene);
+    bool intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) override;
+    void intersectPacket(RayPacket &packet) override;
+    bool intersectShadowRay(const Ray &ray, const id_t lightTriangle) override;
+    size_t memoryUsage() override;
+    void serialize(CacheFile &cache) override;
+    float sahCost() const override;
+    // 8 bytes, children of a node are stored next to each other
     struct KDNode {
-        // leaf
-        std::vector<id_t> trianglesids;
-
-        // node
-        id_t child;
-
-        struct Split {
-            id_t axis;
-            float position;
-        } split;
-
-        bool isLeaf;
+        union {
+            // node: position of the splitting plane
+            float split;
+            // leaf: first of its triangle blocks, while building first of its triangles in leafTriangles
+            id_t trianglesOffset;
+        };
+        id_t axis : 2;
+        id_t isLeaf : 1;
+        // node: index of the left child, the right one follows it; leaf: number of triangles
+        id_t child : 29;
+    };
+    static_assert(sizeof(KDNode) == 8, "kd-tree nodes are expected to be packed into 8 bytes");
+    struct Split {
+        id_t axis;
+        float position;
     };
 
   private:
-    bool intersectRayTriangle(const glm::vec3 &origin, const glm::vec3 &dir, const id_t tri, glm::vec2 &baryPosition,
-                              float &distance);
-    bool intersectRayNode(const glm::vec3 &origin, const glm::vec3 &dir, id_t &triangle, glm::vec2 &baryPosition,
-                          float &distance, KDTree::KDNode &node, float tmin, float tmax);
-    bool intersectShadowRayTriangle(const glm::vec3 &origin, const glm::vec3 &dir, const id_t tri, float dist);
-    bool intersectShadowRayNode(const glm::vec3 &origin, const glm::vec3 &dir, const id_t lightTriangle,
-                                KDTree::KDNode &node, float tmin, float tmax);
-    KDNode build(std::vector<id_t> &tris, glm::vec3 &max, glm::vec3 &min);
-    KDNode::Split findSplit(std::vector<id_t> &tris, glm::vec3 &max, glm::vec3 &min);
-    float triMin(id_t t, id_t axis);
-    float triMax(id_t t, id_t axis);
-    bool inRight(id_t t, float min, id_t axis);
-    bool inLeft(id_t t, float max, id_t axis);
-    std::vector<KDNode> nodes;
+    // seconds spent in every phase of the build
+    struct BuildTimes {
+        float extract;
+        float bounds;
+        float tree;
+        float pack;
+    };
+    // Prints the shape of the tree, its expected cost, memory and build times, and writes the same as JSON to the
+    // file the scene asks for.
+    void report(const Scene &scene, const BuildTimes &times) const;
+    template <typename LeafTest>
+    bool traverse(const Ray &ray, float tmin, float tmax, LeafTest leafTest);
+    // nodes and leaf triangles of a subtree built by one task
+    struct BuildBuffer {
+        std::vector<KDNode> nodes;
+        // triangles of all leaves, each leaf owns a contiguous range
+        std::vector<id_t> leafTriangles;
+    };
+    // triangle in a node while building, with the bounds of its part inside the node's box
+    struct BuildRef {
+        id_t triangle;
+        glm::vec3 min;
+        glm::vec3 max;
+    };
+    KDNode build(std::vector<BuildRef> &refs, glm::vec3 &max, glm::vec3 &min, unsigned depth, BuildBuffer &buffer);
+    KDNode makeLeaf(std::vector<BuildRef> &refs, BuildBuffer &buffer);
+    static KDNode stitch(BuildBuffer &buffer, KDNode root, BuildBuffer &subtree);
+    Split findSplit(std::vector<BuildRef> &refs, glm::vec3 &max, glm::vec3 &min, float &cost);
+    void partition(std::vector<BuildRef> &refs, Split split, std::vector<BuildRef> &left,
+                   std::vector<BuildRef> &right);
+    // Sends a reference to the children it overlaps, a triangle crossing the plane is clipped to each of them.
+    void classify(const BuildRef &ref, Split split, std::vector<BuildRef> &left, std::vector<BuildRef> &right);
+    // Shrinks ref to the part of its triangle inside box min, max, false when nothing is left.
+    bool clip(BuildRef &ref, const glm::vec3 &max, const glm::vec3 &min);
+    Storage<KDNode> nodes;
 };
 
 #endif // KDTREE_H
\ No newline at end of file
@@ -45,6 +45,8 @@ class Mesh {
     bool hasTexture();
     Color getColorAt(glm::vec2 coords);
     void Draw(Shader shaderTexture, Shader shaderMaterial);
+    // Frees vertices once they are uploaded and the ray tracer extracted its triangles, drawing only needs indices.
+    void releaseVertices();
 
     std::vector<Vertex> vertices;
     std::vector<unsigned int> indices;
@@ -17,17 +17,28 @@
 class Scene;
 class Shader;
 
+// Mesh placed in the scene, a mesh used by many nodes of the file is loaded once and placed many times
+struct MeshInstance {
+    unsigned mesh;
+    // object to world space, all transformations of the node and its parents
+    glm::mat4 transform;
+};
+
 class Model {
   public:
     Model(Scene &scene);
     void Draw(Shader shaderTexture, Shader shaderMaterial);
+    // Frees vertices of all meshes, triangles can't be extracted from the model anymore.
+    void releaseVertices();
     std::vector<Mesh> meshes;
+    std::vector<MeshInstance> instances;
 
   private:
     std::string directory;
     std::vector<Texture> textures_loaded;
     void loadModel(std::string path);
-    void processNode(aiNode *node, const aiScene *scene);
+    // loaded[i] is the index in meshes of the i-th mesh of the file, -1 until a node uses it
+    void processNode(aiNode *node, const aiScene *scene, const glm::mat4 &parentTransform, std::vector<int> &loaded);
     Mesh processMesh(aiMesh *mesh, const aiScene *scene);
     std::vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, std::string typeName);
 };
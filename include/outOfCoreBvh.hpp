@@ -0,0 +1,86 @@
+#ifndef OUTOFCOREBVH_H
+#define OUTOFCOREBVH_H
+#include "bvh.hpp"
+#include "wideBvh.hpp"
+
+#include <glm/glm.hpp>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Triangles split into spatial chunks, each with its own tree kept in a file next to the model, which is mapped and
+ * paged in chunk by chunk. A small tree over the chunk boxes stays in memory, and chunks least recently paged in are
+ * dropped whenever those in memory would take more than the scene's budget. Triangle ids go chunk by chunk. */
+class OutOfCoreBVH : public Accelerator {
+  public:
+    typedef WideBVH<simdWidth> ChunkTree;
+    typedef BVH::BVHNode BVHNode;
+    static constexpr unsigned stackSize = 64;
+
+    // key is the one of the scene's cache, the chunk file is only used when written with the same
+    OutOfCoreBVH(Model &model, Scene &scene, uint64_t key);
+    OutOfCoreBVH(Scene &scene, uint64_t key);
+    ~OutOfCoreBVH() override;
+    bool intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) override;
+    bool intersectShadowRay(const Ray &ray, const id_t lightTriangle) override;
+    // the top level tree and the chunks in memory now
+    size_t memoryUsage() override;
+    // the top level tree goes to the cache, the chunks are always in their own file
+    void serialize(CacheFile &cache) override;
+
+    Triangle triangle(id_t id) const override;
+    glm::vec3 normal(id_t id) const override;
+    const Material &material(id_t id) const override;
+    TriangleTexCoords texCoords(id_t id) const override;
+    size_t triangleCount() const override;
+
+    struct Chunk {
+        glm::vec3 min;
+        id_t firstTriangle;
+        glm::vec3 max;
+        id_t triangleCount;
+    };
+
+  protected:
+    bool linkModel(Model &model, Scene &scene) override;
+
+  private:
+    // Splits triangles in order[begin, end) at the median of their centroids until chunks are small enough, every
+    // chunk is a leaf of the top level tree.
+    id_t partition(std::vector<id_t> &order, const std::vector<glm::vec3> &centroids, size_t begin, size_t end,
+                   unsigned depth);
+    // Writes trees of all chunks to their file, one by one, and maps it.
+    void writeChunks(const std::vector<id_t> &order);
+    // Maps the trees of the chunks from their file, false if it doesn't match.
+    bool mapChunks();
+    // Tree of the chunk, paged in unless it is in memory already.
+    ChunkTree &tree(id_t chunk) const;
+    void pageIn(id_t chunk) const;
+    id_t chunkOf(id_t triangle) const;
+    template <typename LeafTest>
+    bool traverse(const Ray &ray, const float &tmax, LeafTest leafTest);
+
+    Scene &scene;
+    const std::string chunkPath;
+    const uint64_t chunkKey;
+    Storage<Chunk> chunks;
+    Storage<BVHNode> nodes;
+    // ids of the light triangles, in the order the model lists them
+    Storage<id_t> lights;
+
+    std::unique_ptr<CacheFile> chunkFile;
+    std::vector<std::unique_ptr<ChunkTree>> trees;
+    // bytes of every chunk in the file, each starting a page
+    std::vector<std::pair<size_t, size_t>> ranges;
+    // A chunk is used with the number of page-ins so far as its time, chunks used since the last page-in share it.
+    struct Residency {
+        std::atomic<bool> resident;
+        std::atomic<uint64_t> lastUse;
+    };
+    mutable std::unique_ptr<Residency[]> residency;
+    mutable std::atomic<uint64_t> pageIns;
+    mutable size_t residentBytes = 0;
+};
+
+#endif // OUTOFCOREBVH_H
@@ -1,10 +1,11 @@
 #ifndef RAY_CASTER_H
 #define RAY_CASTER_H
 
-#include "kdtree.hpp"
+#include "accelerator.hpp"
 #include "scene.hpp"
 
 #include <glm/glm.hpp>
+#include <memory>
 #include <vector>
 
 class RayTracer {
@@ -13,6 +14,12 @@ class RayTracer {
 
     /* Fill pixels with rays shot on screen centered between eye and center. */
     void rayTrace(glm::vec3 eye, glm::vec3 center, glm::vec3 up, float yview);
+    /* Render scene.frames images while the camera and meshes move as the scene says, each to its own numbered file.
+     * The accelerator is refitted between frames and built again only when its SAH cost gets too high. */
+    void renderSequence(Model &model);
+    /* Trace primary and shadow rays only, reporting rays and node visits per second. */
+    void benchmark(glm::vec3 eye, glm::vec3 center, glm::vec3 up, float yview);
+
     /* Get RGB (24 bits per pixel) image location. */
     uint8_t *getData();
 
@@ -26,17 +33,55 @@ class RayTracer {
     /* Export image to file using FreeImage library. */
     void exportImage(const char *filename);
 
+    /* Shadow ray from the hit towards a random point of a random light triangle and the light it brings towards wo
+     * unless something blocks it. False when the scene has no light triangles. */
+    static bool sampleLight(const Accelerator &accelerator, Scene &scene, const glm::vec3 &wo,
+                            const glm::vec3 &intersection, const glm::vec3 &normal, const BRDF &material,
+                            Ray &shadowRay, id_t &lightID, glm::vec3 &contribution);
+
+    /* Direction a path goes on in from its k-th hit, throughput is scaled by the bounce and by the Russian roulette.
+     * False when the path ends there. */
+    static bool bounce(const Scene &scene, const BRDF &material, const glm::vec3 &wo, const glm::vec3 &normal, int k,
+                       glm::vec3 &throughput, glm::vec3 &wi);
+
   private:
-    /* Recursive procedure used by rayTrace method */
-    glm::vec3 sendRay(const glm::vec3 &origin, const glm::vec3 dir, const int k);
+    /* Side of the pixel tiles whose primary rays are traced as one packet. */
+    static constexpr unsigned packetSide = 4;
+    static_assert(packetSide * packetSide == RayPacket::size, "a tile is expected to fill the whole packet");
+
+    /* Upper left corner of the screen and steps between pixels, as directions from eye. */
+    void setupScreen(glm::vec3 eye, glm::vec3 center, glm::vec3 up, float yview, glm::vec3 &leftUpper, glm::vec3 &dx,
+                     glm::vec3 &dy);
+
+    /* One primary ray for every pixel of the tile starting at (tx, ty), row by row. */
+    void fillPacket(RayPacket &packet, unsigned tx, unsigned ty, const glm::vec3 &leftUpper, const glm::vec3 &dx,
+                    const glm::vec3 &dy);
+
+    /* Light arriving at origin from direction dir, a whole path traced by shade. */
+    glm::vec3 sendRay(const glm::vec3 &origin, const glm::vec3 dir);
+
+    /* Light leaving the first hit of a path towards origin. The path is extended hit by hit in a loop carrying its
+     * throughput, until it misses, reaches scene.k hits or loses the Russian roulette. */
+    glm::vec3 shade(glm::vec3 origin, glm::vec3 intersection, glm::vec3 normal, BRDF material);
+
+    /* Light of a random light triangle reflected at the k-th hit of a path towards wo, and emission of the hit itself
+     * when it is the first. */
+    glm::vec3 directLight(const glm::vec3 &wo, const glm::vec3 &intersection, const glm::vec3 &normal,
+                          const BRDF &material, int k);
 
-    /* Ray-model intersection accelerated by kd-tree. Stores result in params: intersection, normal, color, brdf. */
-    bool intersectRayKDTree(const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 &intersection,
-                            glm::vec3 &normal, BRDF *&brdf);
+    /* Ray-model intersection through the accelerator. Stores result in params: intersection, normal, color, brdf. */
+    bool intersectRayModel(const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 &intersection,
+                           glm::vec3 &normal, BRDF &brdf);
 
     Scene &scene;
+    /* Images rendered with the last camera are averaged, layers of them so far. */
+    unsigned layers = 0;
+    glm::vec3 lastEye = glm::vec3(FLT_MAX);
+    glm::vec3 lastCenter = glm::vec3(FLT_MAX);
+    glm::vec3 lastUp = glm::vec3(FLT_MAX);
+    float lastYview = -1;
     std::vector<std::vector<glm::vec3>> pixels;
     std::vector<uint8_t> data;
-    KDTree kdtree;
+    std::unique_ptr<Accelerator> accelerator;
 };
 #endif
\ No newline at end of file
@@ -1,7 +1,7 @@
 #ifndef SCENE_H
 #define SCENE_H
 
-#include "kdtree.hpp"
+#include "accelerator.hpp"
 
 #include <glm/glm.hpp>
 
@@ -21,6 +21,13 @@ struct LightTriangle {
     float surface;
 };
 
+// Mesh sliding along a line during a render sequence
+struct MeshMotion {
+    unsigned mesh;
+    // how far it gets by the last frame
+    glm::vec3 offset;
+};
+
 class Scene {
   public:
     Scene(int argc, char **argv);
@@ -29,7 +36,10 @@ class Scene {
 
     std::string objPath;
     std::string renderPath;
+    // longest path, in surface hits
     int k;
+    // paths at least that long go on with probability of their throughput times albedo
+    int rouletteDepth;
     unsigned xres;
     unsigned yres;
     glm::vec3 VP;
@@ -38,11 +48,46 @@ class Scene {
     float yview;
     std::vector<LightPoint> lightPoints;
     bool usingOpenGLPreview;
+    bool benchmark;
+    bool packets;
+    // paths of a tile are traced breadth first, stage by stage, see Wavefront
+    bool wavefront;
+    // keep the built acceleration structure next to the model and map it on later runs
+    bool cache;
     unsigned int previewHeight;
+    AcceleratorT accelerator;
+    BVHBuilder bvhBuilder;
+    // linear BVHs get their treelets of 7 leaves rearranged for a lower SAH cost afterwards
+    bool lbvhTreelets;
+    // out-of-core structures split triangles into chunks of at most that many and keep chunks of at most chunkBudget
+    // bytes in memory, given in megabytes
+    unsigned chunkTriangles;
+    size_t chunkBudget;
     size_t kdtreeLeafSize;
+    // kd-tree SAH: costs of a traversal step and of a triangle test, share of the cost taken off empty space cuts
+    float kdtreeTraversalCost;
+    float kdtreeIntersectionCost;
+    float kdtreeEmptyBonus;
+    // where a built kd-tree writes its statistics as JSON, they are printed too; such a tree is never loaded from the
+    // cache, there would be no build to time
+    std::string kdtreeStats;
+    // rays remember triangles tested in kd-tree leaves, not to test them again in others
+    bool mailbox;
+    // wide BVHs quantize child boxes to bytes and leaf triangle ids to 16 bits
+    bool compressedNodes;
+    TriangleFormat triangleFormat;
     glm::vec3 background;
     unsigned int samples;
 
+    // render sequence: number of frames, 0 renders a single image
+    unsigned frames;
+    // camera in the last frame, moving linearly from VP and LA
+    glm::vec3 VPEnd;
+    glm::vec3 LAEnd;
+    std::vector<MeshMotion> meshMotions;
+    // refitted structure is built again once its SAH cost grows past this times the cost of the last build
+    float refitThreshold;
+
     // computed by reading model
     std::vector<LightTriangle> lightTriangles;
 
@@ -0,0 +1,153 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// widest vector the compiler targets
+#if defined(__AVX__)
+constexpr unsigned simdWidth = 8;
+#else
+constexpr unsigned simdWidth = 4;
+#endif
+
+/* N floats processed at once, SSE and AVX when the compiler targets them, plain loops otherwise. */
+template <unsigned N> struct vfloat {
+    float v[N];
+
+    static vfloat load(const float *p) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = p[i];
+        return r;
+    }
+    // N bytes converted to floats
+    static vfloat loadBytes(const uint8_t *p) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = p[i];
+        return r;
+    }
+    static vfloat broadcast(float f) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = f;
+        return r;
+    }
+    friend vfloat operator+(const vfloat &a, const vfloat &b) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = a.v[i] + b.v[i];
+        return r;
+    }
+    friend vfloat operator-(const vfloat &a, const vfloat &b) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = a.v[i] - b.v[i];
+        return r;
+    }
+    friend vfloat operator*(const vfloat &a, const vfloat &b) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = a.v[i] * b.v[i];
+        return r;
+    }
+    friend vfloat operator/(const vfloat &a, const vfloat &b) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = a.v[i] / b.v[i];
+        return r;
+    }
+    friend vfloat min(const vfloat &a, const vfloat &b) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+    friend vfloat max(const vfloat &a, const vfloat &b) {
+        vfloat r;
+        for (unsigned i = 0; i < N; i++)
+            r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+    // bit i set when a[i] <= b[i]
+    friend unsigned lessEqual(const vfloat &a, const vfloat &b) {
+        unsigned mask = 0;
+        for (unsigned i = 0; i < N; i++)
+            mask |= unsigned(a.v[i] <= b.v[i]) << i;
+        return mask;
+    }
+    // bit i set when a[i] < b[i]
+    friend unsigned less(const vfloat &a, const vfloat &b) {
+        unsigned mask = 0;
+        for (unsigned i = 0; i < N; i++)
+            mask |= unsigned(a.v[i] < b.v[i]) << i;
+        return mask;
+    }
+    void store(float *p) const {
+        for (unsigned i = 0; i < N; i++)
+            p[i] = v[i];
+    }
+};
+
+#if defined(__SSE__)
+template <> struct vfloat<4> {
+    __m128 v;
+
+    static vfloat load(const float *p) { return {_mm_loadu_ps(p)}; }
+    static vfloat loadBytes(const uint8_t *p) {
+#if defined(__SSE4_1__)
+        int32_t bytes;
+        std::memcpy(&bytes, p, sizeof(bytes));
+        return {_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)))};
+#else
+        return {_mm_setr_ps(p[0], p[1], p[2], p[3])};
+#endif
+    }
+    static vfloat broadcast(float f) { return {_mm_set1_ps(f)}; }
+    friend vfloat operator+(const vfloat &a, const vfloat &b) { return {_mm_add_ps(a.v, b.v)}; }
+    friend vfloat operator-(const vfloat &a, const vfloat &b) { return {_mm_sub_ps(a.v, b.v)}; }
+    friend vfloat operator*(const vfloat &a, const vfloat &b) { return {_mm_mul_ps(a.v, b.v)}; }
+    friend vfloat operator/(const vfloat &a, const vfloat &b) { return {_mm_div_ps(a.v, b.v)}; }
+    friend vfloat min(const vfloat &a, const vfloat &b) { return {_mm_min_ps(a.v, b.v)}; }
+    friend vfloat max(const vfloat &a, const vfloat &b) { return {_mm_max_ps(a.v, b.v)}; }
+    friend unsigned lessEqual(const vfloat &a, const vfloat &b) { return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+    friend unsigned less(const vfloat &a, const vfloat &b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+#endif
+
+#if defined(__AVX__)
+template <> struct vfloat<8> {
+    __m256 v;
+
+    static vfloat load(const float *p) { return {_mm256_loadu_ps(p)}; }
+    static vfloat loadBytes(const uint8_t *p) {
+#if defined(__AVX2__)
+        return {_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))))};
+#else
+        return {_mm256_setr_ps(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7])};
+#endif
+    }
+    static vfloat broadcast(float f) { return {_mm256_set1_ps(f)}; }
+    friend vfloat operator+(const vfloat &a, const vfloat &b) { return {_mm256_add_ps(a.v, b.v)}; }
+    friend vfloat operator-(const vfloat &a, const vfloat &b) { return {_mm256_sub_ps(a.v, b.v)}; }
+    friend vfloat operator*(const vfloat &a, const vfloat &b) { return {_mm256_mul_ps(a.v, b.v)}; }
+    friend vfloat operator/(const vfloat &a, const vfloat &b) { return {_mm256_div_ps(a.v, b.v)}; }
+    friend vfloat min(const vfloat &a, const vfloat &b) { return {_mm256_min_ps(a.v, b.v)}; }
+    friend vfloat max(const vfloat &a, const vfloat &b) { return {_mm256_max_ps(a.v, b.v)}; }
+    friend unsigned lessEqual(const vfloat &a, const vfloat &b) {
+        return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ));
+    }
+    friend unsigned less(const vfloat &a, const vfloat &b) {
+        return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ));
+    }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+#endif
+
+#endif // SIMD_H
@@ -0,0 +1,57 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <omp.h>
+
+#include <atomic>
+#include <cstdint>
+
+/* Counters of the work done while rendering, kept per thread and summed up on request. */
+namespace Stats {
+// MailboxSkips are repeated triangle tests a mailbox saved, MailboxRepeats ones it couldn't as their block held
+// triangles new to the ray too; ChunkPageIns and ChunkEvictions count chunks of an out-of-core structure brought into
+// and dropped from its memory budget
+enum Counter {
+    Rays,
+    ShadowRays,
+    NodeVisits,
+    TriangleTests,
+    MailboxSkips,
+    MailboxRepeats,
+    ChunkPageIns,
+    ChunkEvictions,
+    CountersCount
+};
+
+// lengths of finished paths in surface hits, 0 for primary rays missing everything, the last bin has all longer ones
+constexpr unsigned depthBins = 16;
+
+struct alignas(64) ThreadCounters {
+    uint64_t values[CountersCount];
+    uint64_t depths[depthBins];
+};
+
+constexpr unsigned maxThreads = 256;
+extern ThreadCounters counters[maxThreads];
+
+inline void add(Counter counter, uint64_t value) {
+    counters[omp_get_thread_num() % maxThreads].values[counter] += value;
+}
+
+inline void addPath(unsigned depth) {
+    counters[omp_get_thread_num() % maxThreads].depths[depth < depthBins ? depth : depthBins - 1]++;
+}
+
+/* Sum of the counter over all threads. */
+uint64_t get(Counter counter);
+/* Paths of the depth bin over all threads. */
+uint64_t getPaths(unsigned bin);
+
+void reset();
+
+/* Every operator new of the program, which is replaced in stats.cpp. Threads OpenMP did not start allocate too, so
+ * this one is shared by all of them rather than kept per thread. */
+extern std::atomic<uint64_t> allocations;
+} // namespace Stats
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/* Array which either owns its elements, growing like a vector while a structure is built, or views elements owned by
+ * someone else, like a mapped cache file that has to outlive it. */
+template <typename T> class Storage {
+  public:
+    Storage() {}
+    Storage(std::vector<T> &&elements) { *this = std::move(elements); }
+    Storage &operator=(std::vector<T> &&elements) {
+        owned = std::move(elements);
+        update();
+        return *this;
+    }
+    // moving a vector keeps its buffer, so the pointer stays valid
+    Storage(Storage &&) = default;
+    Storage &operator=(Storage &&) = default;
+
+    // Drops owned elements and shows count of them starting at first instead.
+    void view(T *first, size_t count) {
+        owned.clear();
+        owned.shrink_to_fit();
+        elements = first;
+        elementCount = count;
+    }
+
+    void reserve(size_t count) {
+        owned.reserve(count);
+        update();
+    }
+    void push_back(const T &element) {
+        owned.push_back(element);
+        update();
+    }
+    void resize(size_t count, const T &element) {
+        owned.resize(count, element);
+        update();
+    }
+    void clear() {
+        owned.clear();
+        owned.shrink_to_fit();
+        update();
+    }
+
+    T &operator[](size_t i) { return elements[i]; }
+    const T &operator[](size_t i) const { return elements[i]; }
+    T *data() { return elements; }
+    const T *data() const { return elements; }
+    T *begin() { return elements; }
+    T *end() { return elements + elementCount; }
+    const T *begin() const { return elements; }
+    const T *end() const { return elements + elementCount; }
+    size_t size() const { return elementCount; }
+    bool empty() const { return elementCount == 0; }
+
+  private:
+    void update() {
+        elements = owned.data();
+        elementCount = owned.size();
+    }
+    std::vector<T> owned;
+    T *elements = nullptr;
+    size_t elementCount = 0;
+};
+
+#endif // STORAGE_H
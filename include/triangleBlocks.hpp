@@ -0,0 +1,105 @@
+#ifndef TRIANGLEBLOCKS_H
+#define TRIANGLEBLOCKS_H
+#include "simd.hpp"
+#include "storage.hpp"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+class CacheFile;
+class Geometry;
+struct Ray;
+struct Triangle;
+
+// What is precomputed for every triangle, chosen in the rtc file
+enum class TriangleFormat {
+    // first vertex and both edges, Möller–Trumbore
+    Edges,
+    // the same plus the geometric normal, which saves a cross product per test
+    EdgesNormal,
+    // plane of the triangle and two planes giving barycentric coordinates, rejects by distance first
+    Planes
+};
+
+/* Triangles a ray was tested against, so that one referenced from several leaves is not tested again. Slots are
+ * picked by the triangle and tagged by the ray, starting a new ray costs nothing. Every thread has its own. */
+class alignas(64) Mailbox {
+  public:
+    static constexpr unsigned size = 128;
+    // Mailbox of the calling thread, emptied for a new ray.
+    static Mailbox &forRay();
+    // How many of count triangles at ids the ray was tested against, all of them are put in the mailbox.
+    unsigned seen(const id_t *ids, unsigned count);
+
+  private:
+    struct Slot {
+        uint32_t ray;
+        id_t triangle;
+    };
+    uint32_t ray = 0;
+    Slot slots[size] = {};
+};
+
+/* Triangles of all leaves packed into blocks, laid out lane by lane so that a ray is intersected with a whole block
+ * at once. A leaf owns whole blocks, unused lanes of its last one are degenerate and never hit. */
+class TriangleBlocks {
+  public:
+    static constexpr unsigned size = simdWidth;
+    // a leaf pays for whole blocks, not single triangles
+    static size_t blocksFor(size_t count) { return (count + size - 1) / size; }
+    static unsigned floatsPerTriangle(TriangleFormat format);
+    // Times intersecting every format with random rays and prints it along with memory they need.
+    static void benchmark(const Geometry &triangles);
+
+    explicit TriangleBlocks(TriangleFormat format);
+    void reserve(size_t blockCount);
+    // Packs count triangles listed at ids, returns index of the first of their blocks.
+    id_t pack(const Geometry &triangles, const id_t *ids, id_t count);
+    // Packs every triangle again in the lane it has, after the triangles moved.
+    void repack(const Geometry &triangles);
+    // Stores the triangle of every lane as 16 bits past the smallest one of its block, once all blocks are packed.
+    // Returns false and keeps them whole when a block spans too many ids.
+    bool compactLanes();
+    // Grows min and max by count triangles packed from block first on.
+    void bounds(const Geometry &triangles, id_t first, id_t count, glm::vec3 &min, glm::vec3 &max) const;
+
+    // Closest hit among count triangles packed from block first on, only hits from tnear up to distance are taken.
+    // Blocks whose triangles are all in the mailbox are skipped, triangles of the others are put there.
+    bool intersectRay(const Ray &ray, id_t first, id_t count, id_t &triangle, glm::vec2 &baryPosition,
+                      float &distance, Mailbox *mailbox = nullptr) const;
+    // Is any of count triangles packed from block first on, other than lightTriangle, inside [tnear, tfar).
+    bool intersectShadowRay(const Ray &ray, id_t first, id_t count, id_t lightTriangle,
+                            Mailbox *mailbox = nullptr) const;
+    size_t memoryUsage() const;
+    // Saves the blocks to the cache or maps them from it.
+    void serialize(CacheFile &cache);
+
+    const TriangleFormat format;
+
+  private:
+    // Writes what the format precomputes for the triangle into the lane of the block.
+    void packLane(float *block, unsigned lane, const Triangle &tri);
+    template <TriangleFormat F>
+    bool closestHit(const Ray &ray, id_t first, id_t count, id_t &triangle, glm::vec2 &baryPosition,
+                    float &distance, Mailbox *mailbox) const;
+    template <TriangleFormat F>
+    bool anyHit(const Ray &ray, id_t first, id_t count, id_t lightTriangle, Mailbox *mailbox) const;
+    // Triangle in the lane, counting lanes of all blocks, id_t(-1) in unused ones.
+    id_t laneTriangle(size_t lane) const {
+        if (!laneDeltas.empty())
+            return laneDeltas[lane] == UINT16_MAX ? id_t(-1) : laneBases[lane / size] + laneDeltas[lane];
+        return lanes[lane];
+    }
+    // Triangles of the block's lanes, pointing into lanes or decoded into ids.
+    const id_t *blockTriangles(id_t block, id_t *ids) const;
+    const unsigned rows;
+    // rows of size floats for every block
+    Storage<float> data;
+    // triangle in every lane, id_t(-1) in unused ones
+    Storage<id_t> lanes;
+    // the same once compacted: smallest triangle of every block and offsets from it, UINT16_MAX in unused lanes
+    Storage<id_t> laneBases;
+    Storage<uint16_t> laneDeltas;
+};
+
+#endif // TRIANGLEBLOCKS_H
@@ -0,0 +1,72 @@
+#ifndef TWOLEVELBVH_H
+#define TWOLEVELBVH_H
+#include "bvh.hpp"
+#include "wideBvh.hpp"
+
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+
+/* Two levels of BVHs: every mesh gets its own tree built in its object space and a top level tree over boxes of the
+ * placed instances points to them. Rays are moved into the space of an instance on the way down, so a mesh placed
+ * many times keeps its triangles and its tree only once. Triangle ids go instance by instance, as the model lists
+ * them, and world space triangles are made on demand. */
+class TwoLevelBVH : public Accelerator {
+  public:
+    // tree of every mesh, wide enough to test all children at once
+    typedef WideBVH<simdWidth> MeshTree;
+    typedef BVH::BVHNode BVHNode;
+    // instances in a leaf of the top level tree
+    static constexpr unsigned maxLeafSize = 2;
+    static constexpr unsigned stackSize = 64;
+
+    TwoLevelBVH(Model &model, Scene &scene);
+    explicit TwoLevelBVH(Scene &scene);
+    bool intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) override;
+    bool intersectShadowRay(const Ray &ray, const id_t lightTriangle) override;
+    // both levels, triangles and materials of the meshes are not counted
+    size_t memoryUsage() override;
+    void serialize(CacheFile &cache) override;
+    bool refit(Model &model, Scene &scene) override;
+    float sahCost() const override;
+
+    Triangle triangle(id_t id) const override;
+    glm::vec3 normal(id_t id) const override;
+    const Material &material(id_t id) const override;
+    TriangleTexCoords texCoords(id_t id) const override;
+    size_t triangleCount() const override;
+
+    struct Instance {
+        glm::mat4 toWorld;
+        glm::mat4 toObject;
+        id_t mesh;
+        // id of its first triangle, the following ones are numbered as in the mesh
+        id_t firstTriangle;
+    };
+
+  protected:
+    bool linkModel(Model &model, Scene &scene) override;
+
+  private:
+    // box of every instance in world space, only needed while building
+    struct BuildInstance {
+        glm::vec3 min;
+        glm::vec3 max;
+    };
+    BuildInstance worldBounds(const Instance &instance) const;
+    id_t build(std::vector<BuildInstance> &bounds, size_t begin, size_t end, unsigned depth);
+    // Instance owning the triangle.
+    const Instance &instanceOf(id_t triangle) const;
+    template <typename LeafTest>
+    bool traverse(const Ray &ray, const float &tmax, LeafTest leafTest);
+
+    // for making empty mesh trees when loading from the cache
+    Scene &scene;
+    std::vector<std::unique_ptr<MeshTree>> meshTrees;
+    Storage<Instance> instances;
+    // top level tree, leaves point into leafInstances
+    Storage<BVHNode> nodes;
+    Storage<id_t> leafInstances;
+};
+
+#endif // TWOLEVELBVH_H
@@ -0,0 +1,70 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+#include "accelerator.hpp"
+#include "scene.hpp"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+/* Breadth first path tracing, the engine used instead of RayTracer::sendRay with wavefront in the scene. Paths of a
+ * tile of pixels are kept as arrays of their fields and go through stages together: camera rays are generated for
+ * all of them, all are extended to their closest hits, all hits are shaded, which queues shadow rays and picks the
+ * next directions, all shadow rays are traced, and finished paths are compacted away, until none is left. Every stage
+ * does the same work over thousands of rays, the shape SIMD kernels, sorting by material and coherent memory access
+ * need. Light sampling and bouncing are shared with RayTracer, so both render the same image. */
+class Wavefront {
+  public:
+    // pixels of a tile along either side
+    static constexpr unsigned tileSide = 16;
+    // paths in flight, samples of a tile go through in batches filling about that many
+    static constexpr unsigned queueSize = 1 << 14;
+
+    // Queues are allocated once, an engine is meant to render many tiles on one thread.
+    Wavefront(Accelerator &accelerator, Scene &scene);
+
+    // Sums of all samples of the pixels of the tile starting at (tx, ty), row by row into colors, the screen and its
+    // steps as RayTracer::setupScreen gives them.
+    void renderTile(const glm::vec3 &eye, const glm::vec3 &leftUpper, const glm::vec3 &dx, const glm::vec3 &dy,
+                    unsigned tx, unsigned ty, glm::vec3 *colors);
+
+  private:
+    // Stages, each over all paths in the queue.
+    void generate(const glm::vec3 &eye, const glm::vec3 &leftUpper, const glm::vec3 &dx, const glm::vec3 &dy,
+                  unsigned tx, unsigned ty, unsigned samples);
+    void extend();
+    void shade();
+    void traceShadows();
+    void compact(glm::vec3 *colors);
+
+    Accelerator &accelerator;
+    Scene &scene;
+
+    // state of every path in flight, one array per field
+    struct Paths {
+        std::vector<glm::vec3> origin;
+        std::vector<glm::vec3> dir;
+        std::vector<glm::vec3> throughput;
+        std::vector<glm::vec3> radiance;
+        // index of its pixel in the tile
+        std::vector<unsigned> pixel;
+        // which hit of the path the ray is looking for, from 1
+        std::vector<int> depth;
+        // closest hit found by the last extension
+        std::vector<id_t> triangle;
+        std::vector<glm::vec2> baryPosition;
+        // did the ray hit anything, after shading: does the path go on
+        std::vector<uint8_t> alive;
+    } paths;
+    size_t pathCount = 0;
+
+    // shadow rays queued by shading and the light they bring to their paths unless blocked
+    struct ShadowRays {
+        std::vector<Ray> ray;
+        std::vector<id_t> light;
+        std::vector<glm::vec3> contribution;
+        std::vector<unsigned> path;
+    } shadowRays;
+    size_t shadowCount = 0;
+};
+
+#endif // WAVEFRONT_H
@@ -0,0 +1,69 @@
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+#include "bvh.hpp"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+/* BVH with up to N children per node, made by collapsing the binary one. Boxes of all children are kept axis by axis,
+ * so a ray is tested against all of them at once: N = 4 fits SSE registers, N = 8 fits AVX ones. With compressed-nodes
+ * in the scene, child boxes are quantized to bytes relative to their parent's box and leaves keep 16 bit triangle ids,
+ * which halves the memory of the nodes for a few more instructions per node. */
+template <unsigned N> class WideBVH : public BVH {
+  public:
+    WideBVH(Model &model, Scene &scene);
+    WideBVH(const Mesh &mesh, Scene &scene);
+    WideBVH(const Accelerator &source, const std::vector<id_t> &ids, Scene &scene);
+    explicit WideBVH(Scene &scene);
+    bool intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) override;
+    bool intersectShadowRay(const Ray &ray, const id_t lightTriangle) override;
+    // The same, but only hits nearer than the distance passed in are looked for and rays are not counted in Stats.
+    // Meant for trees of meshes, which see a ray once for every instance it reaches.
+    bool closestHit(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance);
+    bool anyHit(const Ray &ray, const id_t lightTriangle);
+    size_t memoryUsage() override;
+    // the binary nodes are gone, only wide ones are kept
+    void serialize(CacheFile &cache) override;
+    float sahCost() const override;
+
+    struct WideNode {
+        // bounds[0] are minimal and bounds[1] maximal coordinates, bounds[side][axis][i] belongs to the i-th child
+        float bounds[2][3][N];
+        // inner child: index of its node; leaf: first of its triangle blocks
+        id_t child[N];
+        // number of triangles in a leaf, 0 for inner children and unused slots
+        id_t count[N];
+    };
+
+    // 112 bytes for N = 8, 64 for N = 4
+    struct CompressedNode {
+        // corner of the union of the children's boxes, which are on a grid of 2^exponent steps from it
+        float origin[3];
+        int8_t exponent[3];
+        // steps from origin, minima are rounded down and maxima up, so boxes can only grow
+        uint8_t bounds[2][3][N];
+        id_t child[N];
+        uint16_t count[N];
+    };
+
+  protected:
+    void refitNodes() override;
+
+  private:
+    // Collapses the whole binary tree and drops it.
+    void collapseTree();
+    id_t collapse(id_t binary);
+    // Replaces the wide nodes by compressed ones, unless a leaf is too big for them.
+    void compressTree();
+    // Fits the node's grid to the boxes of its used slots and quantizes them.
+    static void quantize(CompressedNode &node, const glm::vec3 *min, const glm::vec3 *max);
+    // Decoded box of a slot, the same the traversal tests.
+    static void slotBounds(const CompressedNode &node, unsigned slot, glm::vec3 &min, glm::vec3 &max);
+    template <typename LeafTest>
+    bool traverse(const Ray &ray, const float &tmax, LeafTest leafTest);
+    // only one of them is filled
+    Storage<WideNode> wideNodes;
+    Storage<CompressedNode> compressedNodes;
+};
+
+#endif // WIDEBVH_H
@@ -7,6 +7,19 @@ int main(int argc, char **argv) {
     OpenGLPreview preview(&scene);
     Model model(scene);
     RayTracer renderer(model, scene);
+    // the ray tracer has its own copy of the triangles, only a sequence moving meshes takes them from the model again
+    if (!scene.frames)
+        model.releaseVertices();
+
+    if (scene.benchmark) {
+        renderer.benchmark(scene.VP, scene.LA, scene.UP, scene.yview);
+        return 0;
+    }
+
+    if (scene.frames) {
+        renderer.renderSequence(model);
+        return 0;
+    }
 
     if (scene.usingOpenGLPreview) {
         preview.setModel(&model);
@@ -0,0 +1,372 @@
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "cacheFile.hpp"
+#include "kdtree.hpp"
+#include "model.hpp"
+#include "outOfCoreBvh.hpp"
+#include "scene.hpp"
+#include "twoLevelBvh.hpp"
+#include "wideBvh.hpp"
+
+#include <glm/gtx/io.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+static bool isLight(const Mesh &mesh) {
+    return mesh.materialColor.emissive.r > 0.f || mesh.materialColor.emissive.g > 0.f ||
+           mesh.materialColor.emissive.b > 0.f;
+}
+
+// Textures loaded once for the model are copied to every mesh using them, with the same image.
+static bool sameTexture(const Texture *a, const Texture *b) { return a == b || (a && b && a->image == b->image); }
+
+static float surface(const Triangle &triangle) {
+    return 0.5f * glm::length(glm::cross(triangle.posSnd - triangle.posFst, triangle.posTrd - triangle.posFst));
+}
+
+static void printLights(const Accelerator &accelerator, const Scene &scene) {
+    std::cout << "Triangles in scene: " << accelerator.triangleCount() << "\n";
+    std::cout << "Surface Lights in scene:";
+    for (auto &light : scene.lightTriangles) {
+        const Triangle triangle = accelerator.triangle(light.id);
+        std::cout << "\nTriangle {" << triangle.posFst << triangle.posSnd << triangle.posTrd << "} of radiance "
+                  << accelerator.material(light.id).Ke << " and surface " << light.surface;
+    }
+    std::cout << (scene.lightTriangles.size() == 0 ? " None.\n" : "\n");
+    std::cout << "Point Lights in scene:";
+    for (auto &light : scene.lightPoints) {
+        std::cout << "\nPosition " << light.position << " of color " << light.color << " and intesity "
+                  << light.intensity;
+    }
+    std::cout << (scene.lightPoints.size() == 0 ? " None.\n" : "\n");
+}
+
+static void printGeometry(const Accelerator &accelerator) {
+    if (accelerator.triangles.empty())
+        return;
+    std::cout << "Triangles share " << accelerator.triangles.positionCount() << " positions, taking "
+              << accelerator.triangles.memoryUsage() << " bytes.\n";
+    const size_t shading = accelerator.shading.size() * sizeof(TriangleShading) +
+                           accelerator.triangleTexCoords.size() * sizeof(TriangleTexCoords);
+    std::cout << "Their normals and texture coordinates take " << shading << " bytes, "
+              << accelerator.materials.size() << " distinct materials "
+              << accelerator.materials.size() * sizeof(Material) << " bytes.\n";
+}
+
+static void printCost(const Accelerator &accelerator) {
+    if (const float cost = accelerator.sahCost())
+        std::cout << "Expected SAH cost of a ray: " << cost << "\n";
+}
+
+// Structure of the kind chosen in scene, to be filled from the cache.
+static Accelerator *createEmpty(Scene &scene, uint64_t key) {
+    switch (scene.accelerator) {
+    case AcceleratorT::KDTree:
+        return new KDTree(scene);
+    case AcceleratorT::BVH:
+        return new BVH(scene);
+    case AcceleratorT::BVH4:
+        return new WideBVH<4>(scene);
+    case AcceleratorT::BVH8:
+        return new WideBVH<8>(scene);
+    case AcceleratorT::TwoLevel:
+        return new TwoLevelBVH(scene);
+    case AcceleratorT::OutOfCore:
+        return new OutOfCoreBVH(scene, key);
+    }
+    return nullptr;
+}
+
+std::unique_ptr<Accelerator> Accelerator::create(Model &model, Scene &scene) {
+    auto beginTime = std::chrono::high_resolution_clock::now();
+    const char *names[] = {"Kd-tree", "BVH", "4-wide BVH", "8-wide BVH", "Two-level BVH", "Out-of-core BVH"};
+    const std::string cachePath = scene.objPath + ".cache";
+
+    std::unique_ptr<CacheFile> cache;
+    const bool timeBuild = scene.accelerator == AcceleratorT::KDTree && !scene.kdtreeStats.empty();
+    // the model is read for its key only once, the out-of-core structure needs it even without the cache
+    const bool useCache = scene.cache && !timeBuild;
+    const uint64_t key = useCache || scene.accelerator == AcceleratorT::OutOfCore ? CacheFile::key(scene) : 0;
+    if (useCache) {
+        cache.reset(new CacheFile(cachePath, key));
+        if (cache->loaded()) {
+            std::unique_ptr<Accelerator> accelerator(createEmpty(scene, key));
+            accelerator->serialize(*cache);
+            if (cache->good() && accelerator->linkModel(model, scene)) {
+                accelerator->cache = std::move(cache);
+                auto finishedTime = std::chrono::high_resolution_clock::now();
+                printLights(*accelerator, scene);
+                std::cout << names[int(scene.accelerator)] << " loaded from " << cachePath << " in "
+                          << (finishedTime - beginTime).count() * 0.000000001f << " seconds.\n";
+                printCost(*accelerator);
+                return accelerator;
+            }
+            std::cerr << "Cache file " << cachePath << " does not match the model, rebuilding it\n";
+            scene.lightTriangles.clear();
+            cache->discard();
+        }
+    }
+
+    std::unique_ptr<Accelerator> accelerator;
+    switch (scene.accelerator) {
+    case AcceleratorT::KDTree:
+        accelerator.reset(new KDTree(model, scene));
+        break;
+    case AcceleratorT::BVH:
+        accelerator.reset(new BVH(model, scene));
+        break;
+    case AcceleratorT::BVH4:
+        accelerator.reset(new WideBVH<4>(model, scene));
+        break;
+    case AcceleratorT::BVH8:
+        accelerator.reset(new WideBVH<8>(model, scene));
+        break;
+    case AcceleratorT::TwoLevel:
+        accelerator.reset(new TwoLevelBVH(model, scene));
+        break;
+    case AcceleratorT::OutOfCore:
+        accelerator.reset(new OutOfCoreBVH(model, scene, key));
+        break;
+    }
+
+    auto finishedTime = std::chrono::high_resolution_clock::now();
+    printLights(*accelerator, scene);
+    const size_t memory = accelerator->memoryUsage();
+    std::cout << names[int(scene.accelerator)] << " built in "
+              << (finishedTime - beginTime).count() * 0.000000001f << " seconds, using " << memory << " bytes ("
+              << float(memory) / accelerator->triangleCount() << " per triangle).\n";
+    printGeometry(*accelerator);
+    printCost(*accelerator);
+
+    if (cache) {
+        accelerator->serialize(*cache);
+        if (!cache->save())
+            std::cerr << "Could not write cache file " << cachePath << "\n";
+    }
+    return accelerator;
+}
+
+Accelerator::Accelerator(Model &model, Scene &scene)
+    : minCoords(FLT_MAX, FLT_MAX, FLT_MAX), maxCoords(-FLT_MAX, -FLT_MAX, -FLT_MAX), blocks(scene.triangleFormat) {
+    auto beginTime = std::chrono::high_resolution_clock::now();
+    size_t indicesCount = 0;
+    for (auto &instance : model.instances)
+        indicesCount += model.meshes[instance.mesh].indices.size();
+    triangles.reserve((indicesCount + 2) / 3);
+    shading.reserve((indicesCount + 2) / 3);
+    triangleTexCoords.reserve((indicesCount + 2) / 3);
+
+    for (auto &instance : model.instances)
+        addMesh(model.meshes[instance.mesh], instance.mesh, instance.transform);
+    triangles.finish();
+    findLights(model, scene);
+
+    minCoords -= 0.0001f;
+    maxCoords += 0.0001f;
+    extractTime = (std::chrono::high_resolution_clock::now() - beginTime).count() * 0.000000001f;
+}
+
+Accelerator::Accelerator(const Mesh &mesh, Scene &scene)
+    : minCoords(FLT_MAX, FLT_MAX, FLT_MAX), maxCoords(-FLT_MAX, -FLT_MAX, -FLT_MAX), blocks(scene.triangleFormat) {
+    triangles.reserve((mesh.indices.size() + 2) / 3);
+    shading.reserve((mesh.indices.size() + 2) / 3);
+    triangleTexCoords.reserve((mesh.indices.size() + 2) / 3);
+    addMesh(mesh, 0, glm::mat4(1.f));
+    triangles.finish();
+
+    minCoords -= 0.0001f;
+    maxCoords += 0.0001f;
+}
+
+Accelerator::Accelerator(const Accelerator &source, const std::vector<id_t> &ids, Scene &scene)
+    : minCoords(FLT_MAX, FLT_MAX, FLT_MAX), maxCoords(-FLT_MAX, -FLT_MAX, -FLT_MAX), blocks(scene.triangleFormat) {
+    triangles.reserve(ids.size());
+    shading.reserve(ids.size());
+    triangleTexCoords.reserve(ids.size());
+    for (id_t id : ids) {
+        const Triangle triangle = source.triangles[id];
+        triangles.addTriangle(triangles.addPosition(triangle.posFst), triangles.addPosition(triangle.posSnd),
+                              triangles.addPosition(triangle.posTrd));
+        shading.push_back(source.shading[id]);
+        triangleTexCoords.push_back(source.triangleTexCoords[id]);
+        minCoords = glm::min(minCoords, glm::min(glm::min(triangle.posFst, triangle.posSnd), triangle.posTrd));
+        maxCoords = glm::max(maxCoords, glm::max(glm::max(triangle.posFst, triangle.posSnd), triangle.posTrd));
+    }
+    triangles.finish();
+
+    minCoords -= 0.0001f;
+    maxCoords += 0.0001f;
+}
+
+Accelerator::Accelerator(Scene &scene) : blocks(scene.triangleFormat) {}
+
+Accelerator::~Accelerator() {}
+
+id_t Accelerator::addMaterial(const Mesh &mesh, id_t meshIndex) {
+    const BRDFT type = isLight(mesh) ? BRDFT::Emissive : BRDFT::Diffuse;
+    // meshes are few, a linear search is enough
+    for (id_t i = 0; i < materials.size(); i++) {
+        const Material &material = materials[i];
+        if (material.BRDFtype == type && material.Kd == mesh.materialColor.diffuse &&
+            material.Ke == mesh.materialColor.emissive && sameTexture(material.texDiffuse, mesh.textureDiffuse))
+            return i;
+    }
+    materials.push_back({.BRDFtype = type,
+                         .Kd = mesh.materialColor.diffuse,
+                         .Ke = mesh.materialColor.emissive,
+                         .texDiffuse = mesh.textureDiffuse,
+                         .mesh = meshIndex});
+    return materials.size() - 1;
+}
+
+void Accelerator::addMesh(const Mesh &mesh, id_t meshIndex, const glm::mat4 &transform) {
+    const glm::mat3 normalTransform = glm::transpose(glm::inverse(glm::mat3(transform)));
+    const id_t material = addMaterial(mesh, meshIndex);
+
+    // every vertex is moved once, vertices differing only in normals or texture coordinates share a position
+    std::vector<id_t> positions(mesh.vertices.size());
+    for (size_t i = 0; i < mesh.vertices.size(); i++)
+        positions[i] = triangles.addPosition(glm::vec3(transform * glm::vec4(mesh.vertices[i].Position, 1.f)));
+
+    for (unsigned i = 0; i < mesh.indices.size(); i += 3) {
+        triangles.addTriangle(positions[mesh.indices[i + 0]], positions[mesh.indices[i + 1]],
+                              positions[mesh.indices[i + 2]]);
+
+        shading.push_back({.normal = transformNormal(normalTransform, (mesh.vertices[mesh.indices[i + 0]].Normal +
+                                                                       mesh.vertices[mesh.indices[i + 1]].Normal +
+                                                                       mesh.vertices[mesh.indices[i + 2]].Normal) /
+                                                                          3.f),
+                           .material = material});
+        triangleTexCoords.push_back({.texFst = mesh.vertices[mesh.indices[i + 0]].TexCoords,
+                                     .texSnd = mesh.vertices[mesh.indices[i + 1]].TexCoords,
+                                     .texTrd = mesh.vertices[mesh.indices[i + 2]].TexCoords});
+
+        const Triangle triangle = triangles[triangles.size() - 1];
+        minCoords = glm::min(minCoords, glm::min(glm::min(triangle.posFst, triangle.posSnd), triangle.posTrd));
+        maxCoords = glm::max(maxCoords, glm::max(glm::max(triangle.posFst, triangle.posSnd), triangle.posTrd));
+    }
+}
+
+void Accelerator::findLights(Model &model, Scene &scene) const {
+    id_t triangleId = 0;
+    for (auto &instance : model.instances) {
+        const Mesh &mesh = model.meshes[instance.mesh];
+        const id_t count = (mesh.indices.size() + 2) / 3;
+        if (isLight(mesh)) {
+            for (id_t i = triangleId; i < triangleId + count; i++)
+                scene.lightTriangles.push_back(LightTriangle(i, surface(triangle(i))));
+        }
+        triangleId += count;
+    }
+}
+
+bool Accelerator::moveTriangles(Model &model, Scene &scene) {
+    size_t triangleCount = 0;
+    for (auto &instance : model.instances)
+        triangleCount += (model.meshes[instance.mesh].indices.size() + 2) / 3;
+    if (triangleCount != triangles.size())
+        return false;
+
+    // mapped arrays are left for owned ones here
+    triangles.clear();
+    shading.clear();
+    triangleTexCoords.clear();
+    materials.clear();
+    triangles.reserve(triangleCount);
+    shading.reserve(triangleCount);
+    triangleTexCoords.reserve(triangleCount);
+    minCoords = glm::vec3(FLT_MAX);
+    maxCoords = glm::vec3(-FLT_MAX);
+    for (auto &instance : model.instances)
+        addMesh(model.meshes[instance.mesh], instance.mesh, instance.transform);
+    triangles.finish();
+    minCoords -= 0.0001f;
+    maxCoords += 0.0001f;
+
+    scene.lightTriangles.clear();
+    findLights(model, scene);
+    return true;
+}
+
+void Accelerator::serialize(CacheFile &cache) {
+    cache.value(minCoords);
+    cache.value(maxCoords);
+    triangles.serialize(cache);
+    cache.array(shading);
+    cache.array(triangleTexCoords);
+    cache.array(materials);
+    blocks.serialize(cache);
+}
+
+bool Accelerator::linkModel(Model &model, Scene &scene) {
+    size_t triangleCount = 0;
+    for (auto &instance : model.instances)
+        triangleCount += (model.meshes[instance.mesh].indices.size() + 2) / 3;
+    if (triangleCount != triangles.size() || shading.size() != triangles.size() ||
+        triangleTexCoords.size() != triangles.size())
+        return false;
+
+    for (auto &material : materials) {
+        if (material.mesh >= model.meshes.size())
+            return false;
+        material.texDiffuse = model.meshes[material.mesh].textureDiffuse;
+    }
+    findLights(model, scene);
+    return true;
+}
+
+void Accelerator::surfaceAt(id_t triangleID, glm::vec2 baryPos, glm::vec3 &intersection, glm::vec3 &normal,
+                            BRDF &brdf) const {
+    const Triangle corners = triangle(triangleID);
+    const Material &hitMaterial = material(triangleID);
+
+    normal = this->normal(triangleID);
+
+    const float baryPosz = (1.f - baryPos.x - baryPos.y);
+    intersection = corners.posFst * baryPosz + corners.posSnd * baryPos.x + corners.posTrd * baryPos.y;
+
+    // texture coordinates are only fetched for textured materials
+    glm::vec3 Kd = hitMaterial.Kd;
+    if (hitMaterial.texDiffuse && hitMaterial.texDiffuse->image) {
+        const TriangleTexCoords tex = texCoords(triangleID);
+        Kd = hitMaterial.texDiffuse->getColorAt(tex.texFst * baryPosz + tex.texSnd * baryPos.x +
+                                                tex.texTrd * baryPos.y);
+    }
+
+    switch (hitMaterial.BRDFtype) {
+    case BRDFT::Diffuse:
+        brdf = BRDF::diffuse(Kd);
+        break;
+    case BRDFT::Emissive:
+        brdf = BRDF::emissive(Kd, hitMaterial.Ke);
+        break;
+    }
+}
+
+Ray::Ray(const glm::vec3 &origin, const glm::vec3 &dir, float tnear, float tfar)
+    : origin(origin), dir(dir), invDir(inverse(dir.x), inverse(dir.y), inverse(dir.z)),
+      sign{invDir.x < 0.f, invDir.y < 0.f, invDir.z < 0.f}, tnear(tnear), tfar(tfar) {}
+
+void Accelerator::intersectPacket(RayPacket &packet) {
+    for (unsigned i = 0; i < packet.count; i++)
+        packet.hit[i] = intersectRay(Ray(packet.origin, packet.dir[i]), packet.triangle[i], packet.baryPosition[i],
+                                     packet.distance[i]);
+}
+
+std::pair<float, float> intersectRayBox(const Ray &ray, const glm::vec3 &max, const glm::vec3 &min) {
+    const glm::vec3 *bounds[2] = {&min, &max};
+    float tnear = -FLT_MAX, tfar = FLT_MAX;
+    for (id_t axis = 0; axis < 3; axis++) {
+        tnear = std::max(tnear, ((*bounds[ray.sign[axis]])[axis] - ray.origin[axis]) * ray.invDir[axis]);
+        tfar = std::min(tfar, ((*bounds[1 - ray.sign[axis]])[axis] - ray.origin[axis]) * ray.invDir[axis]);
+    }
+    return {tnear, tfar};
+}
+
+glm::vec3 transformNormal(const glm::mat3 &normalTransform, const glm::vec3 &normal) {
+    const glm::vec3 transformed = normalTransform * normal;
+    const float length = glm::length(transformed);
+    return length > 0.f ? transformed * (glm::length(normal) / length) : normal;
+}
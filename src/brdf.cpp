@@ -61,15 +61,18 @@ glm::vec3 cosineSampleHemisphere() {
     return ret;
 }
 
-// Generic BRDF
-glm::vec3 BRDF::radiance() { return glm::vec3(0.f); };
-
-BRDF::~BRDF(){};
-
-// A Lambertian (diffuse) material
-glm::vec3 Diffuse::f(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n) { return float(M_1_PI) * color; }
+// Emissive materials reflect as diffuse ones do
+glm::vec3 BRDF::f(const glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n) const {
+    switch (type) {
+    case BRDFT::Diffuse:
+    case BRDFT::Emissive:
+        return float(M_1_PI) * color;
+    }
+    return glm::vec3(0.f);
+}
 
-glm::vec3 Diffuse::sample_wi(glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n, float &pdf) {
+// Cosine weighted hemisphere around the normal, which is what a Lambertian BRDF needs
+glm::vec3 BRDF::sample_wi(glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3 &n, float &pdf) const {
     glm::vec3 tangent = normalize(perpendicular(n));
     glm::vec3 bitangent = normalize(cross(tangent, n));
     glm::vec3 sample = cosineSampleHemisphere();
@@ -78,9 +81,4 @@ glm::vec3 Diffuse::sample_wi(glm::vec3 &wi, const glm::vec3 &wo, const glm::vec3
     return f(wi, wo, n);
 }
 
-Diffuse::~Diffuse(){};
-
-// Emissive material
-glm::vec3 Emissive::radiance() { return radianceColor; }
-
-Emissive::~Emissive(){};
\ No newline at end of file
+glm::vec3 BRDF::radiance() const { return type == BRDFT::Emissive ? radianceColor : glm::vec3(0.f); }
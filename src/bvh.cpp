@@ -0,0 +1,534 @@
+#include "bvh.hpp"
+#include "cacheFile.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+static float surface(const glm::vec3 &min, const glm::vec3 &max) {
+    const glm::vec3 extent = max - min;
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+BVH::BVH(Model &model, Scene &scene) : Accelerator(model, scene) { buildTree(scene); }
+
+BVH::BVH(const Mesh &mesh, Scene &scene) : Accelerator(mesh, scene) { buildTree(scene); }
+
+BVH::BVH(const Accelerator &source, const std::vector<id_t> &ids, Scene &scene) : Accelerator(source, ids, scene) {
+    buildTree(scene);
+}
+
+void BVH::buildTree(const Scene &scene) {
+    std::vector<BuildTriangle> bounds(triangles.size());
+    leafTriangles.resize(triangles.size());
+#pragma omp parallel for
+    for (id_t i = 0; i < triangles.size(); i++) {
+        const Triangle tri = triangles[i];
+        bounds[i].min = glm::min(glm::min(tri.posFst, tri.posSnd), tri.posTrd);
+        bounds[i].max = glm::max(glm::max(tri.posFst, tri.posSnd), tri.posTrd);
+        bounds[i].centroid = 0.5f * (bounds[i].min + bounds[i].max);
+        leafTriangles[i] = i;
+    }
+
+    nodes.reserve(2 * triangles.size());
+    if (triangles.size() && scene.bvhBuilder == BVHBuilder::LBVH)
+        buildLinear(bounds, scene.lbvhTreelets);
+    else if (triangles.size())
+        build(bounds, 0, triangles.size(), stackSize - 1);
+
+    blocks.reserve(TriangleBlocks::blocksFor(triangles.size()) + nodes.size() / 2);
+    for (BVHNode &node : nodes) {
+        if (node.count)
+            node.offset = blocks.pack(triangles, &leafTriangles[node.offset], node.count);
+    }
+    leafTriangles.clear();
+    leafTriangles.shrink_to_fit();
+}
+
+BVH::BVH(Scene &scene) : Accelerator(scene) {}
+
+size_t BVH::memoryUsage() { return nodes.size() * sizeof(BVHNode) + blocks.memoryUsage(); }
+
+void BVH::serialize(CacheFile &cache) {
+    Accelerator::serialize(cache);
+    cache.array(nodes);
+}
+
+bool BVH::refit(Model &model, Scene &scene) {
+    if (!moveTriangles(model, scene))
+        return false;
+    blocks.repack(triangles);
+    refitNodes();
+    return true;
+}
+
+// Children always follow their parent, so going backwards every node sees its children fitted already.
+void BVH::refitNodes() {
+    for (size_t i = nodes.size(); i-- > 0;) {
+        BVHNode &node = nodes[i];
+        if (node.count) {
+            node.min = glm::vec3(FLT_MAX);
+            node.max = glm::vec3(-FLT_MAX);
+            blocks.bounds(triangles, node.offset, node.count, node.min, node.max);
+        } else {
+            node.min = glm::min(nodes[i + 1].min, nodes[node.offset].min);
+            node.max = glm::max(nodes[i + 1].max, nodes[node.offset].max);
+        }
+    }
+}
+
+// The cost the build minimizes, summed over the whole tree: a node is entered with probability of its surface
+// relative to the root's.
+float BVH::sahCost() const {
+    if (nodes.empty() || surface(nodes[0].min, nodes[0].max) <= 0.f)
+        return 0.f;
+    float cost = 0.f;
+    for (const BVHNode &node : nodes)
+        cost += surface(node.min, node.max) *
+                (node.count ? intersectionCost * TriangleBlocks::blocksFor(node.count) : traversalCost);
+    return cost / surface(nodes[0].min, nodes[0].max);
+}
+
+id_t BVH::build(std::vector<BuildTriangle> &bounds, size_t begin, size_t end, unsigned depth) {
+    const id_t index = nodes.size();
+    nodes.push_back({});
+
+    glm::vec3 min(FLT_MAX), max(-FLT_MAX), centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+    for (size_t i = begin; i < end; i++) {
+        const BuildTriangle &tri = bounds[leafTriangles[i]];
+        min = glm::min(min, tri.min);
+        max = glm::max(max, tri.max);
+        centroidMin = glm::min(centroidMin, tri.centroid);
+        centroidMax = glm::max(centroidMax, tri.centroid);
+    }
+    nodes[index].min = min;
+    nodes[index].max = max;
+
+    const size_t count = end - begin;
+    auto makeLeaf = [&]() {
+        nodes[index].offset = begin;
+        nodes[index].count = count;
+        return index;
+    };
+    if (count == 1 || depth == 0)
+        return makeLeaf();
+
+    // bin centroids along every axis and sweep bin boundaries from both sides
+    id_t bestAxis = 3;
+    unsigned bestBin = 0;
+    float bestCost = FLT_MAX;
+    const glm::vec3 extent = centroidMax - centroidMin;
+    for (id_t axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0.f)
+            continue;
+
+        struct {
+            glm::vec3 min = glm::vec3(FLT_MAX), max = glm::vec3(-FLT_MAX);
+            size_t count = 0;
+        } bins[binCount];
+        const float scale = binCount / extent[axis];
+        for (size_t i = begin; i < end; i++) {
+            const BuildTriangle &tri = bounds[leafTriangles[i]];
+            auto &bin = bins[std::min(binCount - 1, unsigned((tri.centroid[axis] - centroidMin[axis]) * scale))];
+            bin.min = glm::min(bin.min, tri.min);
+            bin.max = glm::max(bin.max, tri.max);
+            bin.count++;
+        }
+
+        float rightCost[binCount];
+        glm::vec3 sweepMin(FLT_MAX), sweepMax(-FLT_MAX);
+        size_t sweepCount = 0;
+        for (unsigned bin = binCount - 1; bin > 0; bin--) {
+            sweepMin = glm::min(sweepMin, bins[bin].min);
+            sweepMax = glm::max(sweepMax, bins[bin].max);
+            sweepCount += bins[bin].count;
+            rightCost[bin] = sweepCount ? surface(sweepMin, sweepMax) * TriangleBlocks::blocksFor(sweepCount) : 0.f;
+        }
+        sweepMin = glm::vec3(FLT_MAX);
+        sweepMax = glm::vec3(-FLT_MAX);
+        sweepCount = 0;
+        for (unsigned bin = 1; bin < binCount; bin++) {
+            sweepMin = glm::min(sweepMin, bins[bin - 1].min);
+            sweepMax = glm::max(sweepMax, bins[bin - 1].max);
+            sweepCount += bins[bin - 1].count;
+            if (sweepCount == 0 || sweepCount == count)
+                continue;
+            const float cost = surface(sweepMin, sweepMax) * TriangleBlocks::blocksFor(sweepCount) + rightCost[bin];
+            if (cost < bestCost) {
+                bestAxis = axis;
+                bestBin = bin;
+                bestCost = cost;
+            }
+        }
+    }
+
+    size_t middle;
+    if (bestAxis == 3) {
+        // all centroids in one point, nothing to tell triangles apart
+        if (count <= maxLeafSize)
+            return makeLeaf();
+        middle = begin + count / 2;
+    } else {
+        bestCost = traversalCost + intersectionCost * bestCost / surface(min, max);
+        if (bestCost >= intersectionCost * TriangleBlocks::blocksFor(count) && count <= maxLeafSize)
+            return makeLeaf();
+
+        const float scale = binCount / extent[bestAxis];
+        middle = std::partition(leafTriangles.begin() + begin, leafTriangles.begin() + end,
+                                [&](id_t tri) {
+                                    return std::min(binCount - 1, unsigned((bounds[tri].centroid[bestAxis] -
+                                                                            centroidMin[bestAxis]) *
+                                                                           scale)) < bestBin;
+                                }) -
+                 leafTriangles.begin();
+    }
+
+    nodes[index].count = 0;
+    build(bounds, begin, middle, depth - 1);
+    const id_t right = build(bounds, middle, end, depth - 1);
+    nodes[index].offset = right;
+    return index;
+}
+
+// Binary tree of the linear builder: inner nodes first, then a leaf for every triangle in Morton order.
+struct LinearNode {
+    glm::vec3 min;
+    glm::vec3 max;
+    // children of inner nodes, -1 for leaves
+    id_t left;
+    id_t right;
+    // leaves own count triangles from offset on in Morton order
+    id_t offset;
+    id_t count;
+    // SAH cost of the subtree, not divided by the surface of the root
+    float cost;
+};
+
+// Spreads the low 10 bits of v so that two zero bits follow each of them.
+static uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 30 bit code of a point in the unit cube, 10 bits of every coordinate interleaved.
+static uint32_t mortonCode(const glm::vec3 &point) {
+    const glm::vec3 scaled = glm::clamp(point * 1024.f, 0.f, 1023.f);
+    return expandBits(uint32_t(scaled.x)) << 2 | expandBits(uint32_t(scaled.y)) << 1 | expandBits(uint32_t(scaled.z));
+}
+
+// Length of the common prefix of sorted codes i and j, equal codes are told apart by their positions.
+static int commonPrefix(const std::vector<uint32_t> &codes, int64_t i, int64_t j) {
+    if (j < 0 || j >= int64_t(codes.size()))
+        return -1;
+    if (codes[i] != codes[j])
+        return __builtin_clz(codes[i] ^ codes[j]);
+    return 32 + __builtin_clz(uint32_t(i ^ j));
+}
+
+/* Range of codes below inner node i of the radix tree over sorted codes and where it splits, after Karras,
+ * "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees". Every node is found on its own:
+ * node i starts or ends at code i and reaches as far as codes share a longer prefix with it than with the code on
+ * the other side. */
+static void radixNode(const std::vector<uint32_t> &codes, int64_t i, int64_t &first, int64_t &last, int64_t &split) {
+    const int64_t d = commonPrefix(codes, i, i + 1) > commonPrefix(codes, i, i - 1) ? 1 : -1;
+    const int minPrefix = commonPrefix(codes, i, i - d);
+    int64_t maxLength = 2;
+    while (commonPrefix(codes, i, i + maxLength * d) > minPrefix)
+        maxLength *= 2;
+    int64_t length = 0;
+    for (int64_t t = maxLength / 2; t >= 1; t /= 2) {
+        if (commonPrefix(codes, i, i + (length + t) * d) > minPrefix)
+            length += t;
+    }
+    const int64_t j = i + length * d;
+    const int nodePrefix = commonPrefix(codes, i, j);
+    int64_t step = 0;
+    int64_t t = length;
+    do {
+        t = (t + 1) / 2;
+        if (commonPrefix(codes, i, i + (step + t) * d) > nodePrefix)
+            step += t;
+    } while (t > 1);
+    split = i + step * d + std::min<int64_t>(d, 0);
+    first = std::min(i, j);
+    last = std::max(i, j);
+}
+
+// Gives a subset of treelet leaves its node, split as the table says. Inner nodes of the old treelet are reused, the
+// root first.
+static id_t formTreelet(std::vector<LinearNode> &linear, const id_t *leaves, const id_t *inner, const uint8_t *split,
+                        unsigned subset, unsigned &nextInner) {
+    if (!(subset & (subset - 1)))
+        return leaves[__builtin_ctz(subset)];
+    const id_t index = inner[nextInner++];
+    const id_t left = formTreelet(linear, leaves, inner, split, split[subset], nextInner);
+    const id_t right = formTreelet(linear, leaves, inner, split, subset ^ split[subset], nextInner);
+    LinearNode &node = linear[index];
+    node.left = left;
+    node.right = right;
+    node.min = glm::min(linear[left].min, linear[right].min);
+    node.max = glm::max(linear[left].max, linear[right].max);
+    node.count = linear[left].count + linear[right].count;
+    node.cost = BVH::traversalCost * surface(node.min, node.max) + linear[left].cost + linear[right].cost;
+    return index;
+}
+
+/* Treelet restructuring after Karras and Aila, "Fast Parallel Construction of High-Quality Bounding Volume
+ * Hierarchies": the root's subtree is opened at the biggest inner nodes until it has treeletSize leaves and the
+ * cheapest binary tree over these leaves replaces it, found by trying every split of every subset of them. */
+static void restructureTreelet(std::vector<LinearNode> &linear, id_t root) {
+    constexpr unsigned size = BVH::treeletSize;
+    id_t leaves[size], inner[size - 1];
+    unsigned leafCount = 2, innerCount = 1;
+    inner[0] = root;
+    leaves[0] = linear[root].left;
+    leaves[1] = linear[root].right;
+    while (leafCount < size) {
+        unsigned largest = size;
+        float largestSurface = -1.f;
+        for (unsigned i = 0; i < leafCount; i++) {
+            const LinearNode &node = linear[leaves[i]];
+            if (node.left != id_t(-1) && surface(node.min, node.max) > largestSurface) {
+                largest = i;
+                largestSurface = surface(node.min, node.max);
+            }
+        }
+        if (largest == size)
+            break;
+        const id_t opened = leaves[largest];
+        inner[innerCount++] = opened;
+        leaves[largest] = linear[opened].left;
+        leaves[leafCount++] = linear[opened].right;
+    }
+    // two leaves can only be put together one way
+    if (leafCount < 3)
+        return;
+
+    const unsigned full = (1u << leafCount) - 1;
+    float cost[1u << size];
+    uint8_t split[1u << size];
+    for (unsigned i = 0; i < leafCount; i++)
+        cost[1u << i] = linear[leaves[i]].cost;
+    // parts of a subset are smaller numbers, so they are done before it
+    for (unsigned subset = 3; subset <= full; subset++) {
+        if (!(subset & (subset - 1)))
+            continue;
+        glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+        for (unsigned i = 0; i < leafCount; i++) {
+            if (subset >> i & 1) {
+                min = glm::min(min, linear[leaves[i]].min);
+                max = glm::max(max, linear[leaves[i]].max);
+            }
+        }
+        // one part takes the lowest leaf, so every split is tried once
+        const unsigned lowest = subset & (0u - subset);
+        float best = FLT_MAX;
+        for (unsigned part = (subset - 1) & subset; part; part = (part - 1) & subset) {
+            if ((part & lowest) && cost[part] + cost[subset ^ part] < best) {
+                best = cost[part] + cost[subset ^ part];
+                split[subset] = part;
+            }
+        }
+        cost[subset] = BVH::traversalCost * surface(min, max) + best;
+    }
+    if (cost[full] >= linear[root].cost)
+        return;
+    unsigned nextInner = 0;
+    formTreelet(linear, leaves, inner, split, full, nextInner);
+}
+
+// Triangles of a subtree, left to right.
+static void gather(const std::vector<LinearNode> &linear, id_t id, const std::vector<id_t> &sorted,
+                   std::vector<id_t> &triangles) {
+    const LinearNode &node = linear[id];
+    if (node.left == id_t(-1))
+        triangles.insert(triangles.end(), sorted.begin() + node.offset, sorted.begin() + node.offset + node.count);
+    else {
+        gather(linear, node.left, sorted, triangles);
+        gather(linear, node.right, sorted, triangles);
+    }
+}
+
+// Lays a subtree out depth first like the SAH builder does, leaves own ranges of triangles gathered in the same
+// order. Subtrees deeper than the traversal stack allows become single leaves.
+static id_t flatten(const std::vector<LinearNode> &linear, id_t id, unsigned depth, const std::vector<id_t> &sorted,
+                    Storage<BVH::BVHNode> &nodes, std::vector<id_t> &triangles) {
+    const LinearNode &node = linear[id];
+    const id_t index = nodes.size();
+    nodes.push_back({node.min, 0, node.max, 0});
+    if (node.left == id_t(-1) || depth == 0) {
+        nodes[index].offset = triangles.size();
+        nodes[index].count = node.count;
+        gather(linear, id, sorted, triangles);
+        return index;
+    }
+    flatten(linear, node.left, depth - 1, sorted, nodes, triangles);
+    const id_t right = flatten(linear, node.right, depth - 1, sorted, nodes, triangles);
+    nodes[index].offset = right;
+    return index;
+}
+
+/* Linear BVH: Morton codes of the centroids are sorted by radix and the radix tree over them gives all inner nodes
+ * at once. Boxes and costs go up from the leaves, the second child to finish fits its parent, small subtrees
+ * collapse into leaves when the SAH prefers it and larger ones may have their treelets rearranged on the way. */
+void BVH::buildLinear(const std::vector<BuildTriangle> &bounds, bool restructure) {
+    const int64_t count = bounds.size();
+    glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+    for (const BuildTriangle &tri : bounds) {
+        centroidMin = glm::min(centroidMin, tri.centroid);
+        centroidMax = glm::max(centroidMax, tri.centroid);
+    }
+    glm::vec3 scale(0.f);
+    for (id_t axis = 0; axis < 3; axis++) {
+        if (centroidMax[axis] > centroidMin[axis])
+            scale[axis] = 1.f / (centroidMax[axis] - centroidMin[axis]);
+    }
+
+    // code in the high half and triangle in the low one, the sort is stable so equal codes keep triangle order
+    std::vector<uint64_t> keys(count), buffer(count);
+#pragma omp parallel for
+    for (int64_t i = 0; i < count; i++)
+        keys[i] = uint64_t(mortonCode((bounds[i].centroid - centroidMin) * scale)) << 32 | uint64_t(i);
+    for (unsigned shift = 32; shift < 62; shift += 10) {
+        size_t offsets[1025] = {};
+        for (uint64_t key : keys)
+            offsets[(key >> shift & 1023) + 1]++;
+        for (unsigned digit = 0; digit < 1024; digit++)
+            offsets[digit + 1] += offsets[digit];
+        for (uint64_t key : keys)
+            buffer[offsets[key >> shift & 1023]++] = key;
+        keys.swap(buffer);
+    }
+    std::vector<uint32_t> codes(count);
+    std::vector<id_t> sorted(count);
+    for (int64_t i = 0; i < count; i++) {
+        codes[i] = keys[i] >> 32;
+        sorted[i] = id_t(keys[i]);
+    }
+    std::vector<uint64_t>().swap(keys);
+    std::vector<uint64_t>().swap(buffer);
+
+    // inner node i is at i, leaf of the i-th triangle at count - 1 + i, the root is at 0 either way
+    std::vector<LinearNode> linear(2 * count - 1);
+    std::vector<id_t> parents(2 * count - 1);
+    parents[0] = id_t(-1);
+#pragma omp parallel for
+    for (int64_t i = 0; i < count - 1; i++) {
+        int64_t first, last, split;
+        radixNode(codes, i, first, last, split);
+        LinearNode &node = linear[i];
+        node.left = first == split ? count - 1 + split : split;
+        node.right = last == split + 1 ? count + split : split + 1;
+        node.offset = first;
+        node.count = last - first + 1;
+        parents[node.left] = i;
+        parents[node.right] = i;
+    }
+
+    std::vector<std::atomic<unsigned>> arrived(count);
+#pragma omp parallel for
+    for (int64_t i = 0; i < count; i++) {
+        const BuildTriangle &tri = bounds[sorted[i]];
+        const float leafCost = intersectionCost * TriangleBlocks::blocksFor(1) * surface(tri.min, tri.max);
+        linear[count - 1 + i] = {tri.min, tri.max, id_t(-1), id_t(-1), id_t(i), 1, leafCost};
+        for (id_t id = parents[count - 1 + i]; id != id_t(-1); id = parents[id]) {
+            // the first child to arrive leaves its parent to the other one
+            if (arrived[id].fetch_add(1, std::memory_order_acq_rel) == 0)
+                break;
+            LinearNode &node = linear[id];
+            const LinearNode &left = linear[node.left];
+            const LinearNode &right = linear[node.right];
+            node.min = glm::min(left.min, right.min);
+            node.max = glm::max(left.max, right.max);
+            node.cost = traversalCost * surface(node.min, node.max) + left.cost + right.cost;
+            const float leafCost =
+                intersectionCost * TriangleBlocks::blocksFor(node.count) * surface(node.min, node.max);
+            if (node.count <= maxLeafSize && leafCost <= node.cost) {
+                node.left = id_t(-1);
+                node.right = id_t(-1);
+                node.cost = leafCost;
+            } else if (restructure && node.count >= treeletSize)
+                restructureTreelet(linear, id);
+        }
+    }
+
+    leafTriangles.clear();
+    leafTriangles.reserve(count);
+    flatten(linear, 0, stackSize - 1, sorted, nodes, leafTriangles);
+}
+
+/* Front to back traversal of nodes whose boxes the ray enters before tmax. For every leaf reached
+ * leafTest(leaf) is called, returning true stops the traversal. tmax is read again after every leaf,
+ * so the test may shorten it. */
+template <typename LeafTest> bool BVH::traverse(const Ray &ray, const float &tmax, LeafTest leafTest) {
+    auto enter = [&](const BVHNode &node) {
+        const glm::vec3 t0 = (node.min - ray.origin) * ray.invDir;
+        const glm::vec3 t1 = (node.max - ray.origin) * ray.invDir;
+        const glm::vec3 tsmall = glm::min(t0, t1);
+        const glm::vec3 tbig = glm::max(t0, t1);
+        const float tnear = std::max(std::max(tsmall.x, tsmall.y), std::max(tsmall.z, ray.tnear));
+        const float tfar = std::min(std::min(tbig.x, tbig.y), std::min(tbig.z, tmax));
+        return tnear <= tfar ? tnear : FLT_MAX;
+    };
+    id_t stack[stackSize];
+    unsigned stackTop = 0;
+    uint64_t visits = 0;
+    id_t index = 0;
+    if (nodes.empty() || enter(nodes[0]) == FLT_MAX)
+        index = id_t(-1);
+
+    while (index != id_t(-1)) {
+        const BVHNode &node = nodes[index];
+        visits++;
+        if (node.count) {
+            if (leafTest(node)) {
+                Stats::add(Stats::NodeVisits, visits);
+                return true;
+            }
+            index = stackTop ? stack[--stackTop] : id_t(-1);
+            continue;
+        }
+
+        id_t near = index + 1;
+        id_t far = node.offset;
+        float tnear = enter(nodes[near]);
+        float tfar = enter(nodes[far]);
+        if (tfar < tnear) {
+            std::swap(near, far);
+            std::swap(tnear, tfar);
+        }
+        if (tnear == FLT_MAX)
+            index = stackTop ? stack[--stackTop] : id_t(-1);
+        else {
+            if (tfar != FLT_MAX)
+                stack[stackTop++] = far;
+            index = near;
+        }
+    }
+    Stats::add(Stats::NodeVisits, visits);
+    return false;
+}
+
+bool BVH::intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) {
+    Stats::add(Stats::Rays, 1);
+    bool found = false;
+    distance = ray.tfar;
+    auto closestHit = [&](const BVHNode &leaf) {
+        found |= blocks.intersectRay(ray, leaf.offset, leaf.count, triangle, baryPosition, distance);
+        return false;
+    };
+    traverse(ray, distance, closestHit);
+    return found;
+}
+
+bool BVH::intersectShadowRay(const Ray &ray, const id_t lightTriangle) {
+    Stats::add(Stats::ShadowRays, 1);
+    auto anyHit = [&](const BVHNode &leaf) {
+        return blocks.intersectShadowRay(ray, leaf.offset, leaf.count, lightTriangle);
+    };
+    return traverse(ray, ray.tfar, anyHit);
+}
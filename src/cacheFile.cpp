@@ -0,0 +1,197 @@
+#include "cacheFile.hpp"
+#include "scene.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// bumped whenever the layout of anything stored changes
+static constexpr uint64_t cacheVersion = 4;
+static const char cacheMagic[8] = {'C', 'H', 'I', 'A', 'R', 'O', 'C', '\0'};
+
+// FNV-1a
+static uint64_t hash(uint64_t seed, const void *bytes, size_t count) {
+    const unsigned char *data = static_cast<const unsigned char *>(bytes);
+    for (size_t i = 0; i < count; i++)
+        seed = (seed ^ data[i]) * 1099511628211ull;
+    return seed;
+}
+
+// FNV-1a taking 8 bytes at a step, for whole files
+static uint64_t hashWords(uint64_t seed, const char *bytes, size_t count) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        seed = (seed ^ word) * 1099511628211ull;
+    }
+    return hash(seed, bytes + i, count - i);
+}
+
+/* Streams the file through a fixed buffer, collecting names of the material libraries it refers to when asked. Only
+ * a line that may still be an mtllib line is kept while it spans buffers. */
+static uint64_t hashFile(uint64_t seed, const std::string &path, std::vector<std::string> *mtllibs = nullptr) {
+    static const std::string prefix = "mtllib ";
+    seed = hash(seed, path.data(), path.size());
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> buffer(1 << 16);
+    std::string line;
+    bool candidate = true;
+    auto endLine = [&]() {
+        if (candidate && line.size() > prefix.size()) {
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            mtllibs->push_back(line.substr(prefix.size()));
+        }
+        line.clear();
+        candidate = true;
+    };
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        const size_t count = file.gcount();
+        seed = hashWords(seed, buffer.data(), count);
+        if (!mtllibs)
+            continue;
+        const char *end = buffer.data() + count;
+        for (const char *begin = buffer.data(); begin < end;) {
+            const char *newline = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+            const char *stop = newline ? newline : end;
+            if (candidate) {
+                line.append(begin, stop);
+                const size_t compared = std::min(line.size(), prefix.size());
+                candidate = line.compare(0, compared, prefix, 0, compared) == 0;
+            }
+            if (!candidate)
+                line.clear();
+            if (newline)
+                endLine();
+            begin = newline ? newline + 1 : end;
+        }
+    }
+    if (mtllibs)
+        endLine();
+    return seed;
+}
+
+uint64_t CacheFile::key(const Scene &scene) {
+    std::vector<std::string> mtllibs;
+    uint64_t key = hashFile(14695981039346656037ull, scene.objPath, &mtllibs);
+
+    // materials the OBJ file refers to, relative to its directory
+    const size_t slash = scene.objPath.find_last_of('/');
+    const std::string directory = slash == std::string::npos ? "" : scene.objPath.substr(0, slash + 1);
+    for (const std::string &name : mtllibs)
+        key = hashFile(key, directory + name);
+
+    const uint64_t settings[] = {cacheVersion,
+                                 scene.kdtreeLeafSize,
+                                 uint64_t(scene.accelerator),
+                                 uint64_t(scene.bvhBuilder),
+                                 scene.lbvhTreelets,
+                                 scene.chunkTriangles,
+                                 uint64_t(scene.triangleFormat),
+                                 scene.compressedNodes,
+                                 TriangleBlocks::size};
+    key = hash(key, settings, sizeof(settings));
+    const float costs[] = {scene.kdtreeTraversalCost, scene.kdtreeIntersectionCost, scene.kdtreeEmptyBonus};
+    return hash(key, costs, sizeof(costs));
+}
+
+CacheFile::CacheFile(const std::string &path, uint64_t key) : path(path), fileKey(key) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat status;
+    Header header;
+    if (fstat(fd, &status) == 0 && size_t(status.st_size) >= sizeof(Header) &&
+        pread(fd, &header, sizeof(Header), 0) == sizeof(Header) &&
+        std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0 && header.key == key &&
+        header.size == uint64_t(status.st_size)) {
+        // private, so that pointers inside may be patched without touching the file
+        void *address = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            mapping = static_cast<char *>(address);
+            mappingSize = status.st_size;
+            offset = sizeof(Header);
+        }
+    }
+    close(fd);
+}
+
+CacheFile::~CacheFile() { discard(); }
+
+void CacheFile::discard() {
+    if (mapping)
+        munmap(mapping, mappingSize);
+    mapping = nullptr;
+    mappingSize = 0;
+    offset = 0;
+    truncated = false;
+}
+
+size_t CacheFile::page() {
+    if (loaded()) {
+        offset = (offset + pageSize - 1) / pageSize * pageSize;
+        return offset;
+    }
+    if (contents.empty())
+        contents.resize(sizeof(Header));
+    contents.resize((contents.size() + pageSize - 1) / pageSize * pageSize);
+    return contents.size();
+}
+
+size_t CacheFile::position() const {
+    if (loaded())
+        return offset;
+    return std::max(contents.size(), sizeof(Header));
+}
+
+void CacheFile::advise(size_t begin, size_t end, bool needed) {
+    end = std::min(end, mappingSize);
+    if (mapping && begin < end)
+        madvise(mapping + begin, end - begin, needed ? MADV_WILLNEED : MADV_DONTNEED);
+}
+
+char *CacheFile::read(size_t bytes) {
+    offset = (offset + alignment - 1) / alignment * alignment;
+    if (truncated || offset + bytes > mappingSize) {
+        truncated = true;
+        return nullptr;
+    }
+    char *position = mapping + offset;
+    offset += bytes;
+    return position;
+}
+
+void CacheFile::write(const void *bytes, size_t count) {
+    if (contents.empty())
+        contents.resize(sizeof(Header));
+    contents.resize((contents.size() + alignment - 1) / alignment * alignment);
+    contents.insert(contents.end(), static_cast<const char *>(bytes), static_cast<const char *>(bytes) + count);
+}
+
+bool CacheFile::save() {
+    if (contents.empty())
+        contents.resize(sizeof(Header));
+    Header header;
+    std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.key = fileKey;
+    header.size = contents.size();
+    std::memcpy(contents.data(), &header, sizeof(Header));
+
+    // written aside and renamed, so a concurrent run never maps a half written file
+    const std::string temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(contents.data(), contents.size());
+    file.close();
+    if (!file || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
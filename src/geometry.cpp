@@ -0,0 +1,52 @@
+#include "geometry.hpp"
+#include "cacheFile.hpp"
+
+#include <cstring>
+
+size_t Geometry::PositionHash::operator()(const glm::vec3 &position) const {
+    // -0 and 0 compare equal, so they have to hash the same
+    uint32_t bits[3];
+    const float coords[3] = {position.x + 0.f, position.y + 0.f, position.z + 0.f};
+    std::memcpy(bits, coords, sizeof(bits));
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t b : bits)
+        hash = (hash ^ b) * 1099511628211ull;
+    return hash;
+}
+
+void Geometry::reserve(size_t triangleCount) {
+    indices.reserve(3 * triangleCount);
+    // closed meshes have about half as many vertices as triangles
+    positions.reserve(triangleCount / 2 + 3);
+    added.reserve(triangleCount / 2 + 3);
+}
+
+id_t Geometry::addPosition(const glm::vec3 &position) {
+    auto inserted = added.emplace(position, positions.size());
+    if (inserted.second)
+        positions.push_back(position);
+    return inserted.first->second;
+}
+
+void Geometry::addTriangle(id_t fst, id_t snd, id_t trd) {
+    indices.push_back(fst);
+    indices.push_back(snd);
+    indices.push_back(trd);
+}
+
+void Geometry::finish() { std::unordered_map<glm::vec3, id_t, PositionHash>().swap(added); }
+
+void Geometry::clear() {
+    positions.clear();
+    indices.clear();
+    finish();
+}
+
+size_t Geometry::memoryUsage() const {
+    return positions.size() * sizeof(glm::vec3) + indices.size() * sizeof(uint32_t);
+}
+
+void Geometry::serialize(CacheFile &cache) {
+    cache.array(positions);
+    cache.array(indices);
+}
@@ -1,138 +1,371 @@
 #include "kdtree.hpp"
-#include "model.hpp"
+#include "cacheFile.hpp"
 #include "scene.hpp"
-
-#include <glm/gtx/io.hpp>
+#include "stats.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
 #include <iostream>
 
-float KDTree::triMax(id_t t, id_t axis) {
-    float max = triangles[t].posFst[axis];
-    max = triangles[t].posSnd[axis] > max ? triangles[t].posSnd[axis] : max;
-    return triangles[t].posTrd[axis] > max ? triangles[t].posTrd[axis] : max;
-}
+/* Sutherland–Hodgman clipping of the triangle against the six planes of the box, widened by a small tolerance so that
+ * a triangle is never lost to rounding. The bounds of what is left are then cut down to the box itself. */
+bool KDTree::clip(BuildRef &ref, const glm::vec3 &max, const glm::vec3 &min) {
+    const Triangle tri = triangles[ref.triangle];
+    // a triangle has 3 vertices, every plane adds at most one
+    glm::vec3 polygon[2][9] = {{tri.posFst, tri.posSnd, tri.posTrd}};
+    unsigned count = 3;
+    unsigned current = 0;
+
+    const glm::vec3 magnitude = glm::max(glm::abs(min), glm::abs(max));
+    const float tolerance = 1e-5f * std::max(std::max(magnitude.x, magnitude.y), magnitude.z);
+    for (id_t axis = 0; axis < 3 && count; axis++) {
+        for (int side = 0; side < 2 && count; side++) {
+            // distance inside the widened plane, points with negative one are cut off
+            auto inside = [&](const glm::vec3 &p) {
+                return tolerance + (side ? max[axis] - p[axis] : p[axis] - min[axis]);
+            };
+            const glm::vec3 *in = polygon[current];
+            glm::vec3 *out = polygon[current ^ 1];
+            unsigned outCount = 0;
+            for (unsigned i = 0; i < count; i++) {
+                const glm::vec3 &from = in[i];
+                const glm::vec3 &to = in[(i + 1) % count];
+                const float fromInside = inside(from);
+                const float toInside = inside(to);
+                if (fromInside >= 0.f)
+                    out[outCount++] = from;
+                if ((fromInside < 0.f) != (toInside < 0.f))
+                    out[outCount++] = from + (to - from) * (fromInside / (fromInside - toInside));
+            }
+            count = std::min(outCount, 9u);
+            current ^= 1;
+        }
+    }
+    if (!count)
+        return false;
 
-float KDTree::triMin(id_t t, id_t axis) {
-    float min = triangles[t].posFst[axis];
-    min = triangles[t].posSnd[axis] < min ? triangles[t].posSnd[axis] : min;
-    return triangles[t].posTrd[axis] < min ? triangles[t].posTrd[axis] : min;
+    ref.min = glm::vec3(FLT_MAX);
+    ref.max = glm::vec3(-FLT_MAX);
+    for (unsigned i = 0; i < count; i++) {
+        ref.min = glm::min(ref.min, polygon[current][i]);
+        ref.max = glm::max(ref.max, polygon[current][i]);
+    }
+    ref.min = glm::clamp(ref.min, min, max);
+    ref.max = glm::clamp(ref.max, min, max);
+    return true;
 }
 
-bool KDTree::inLeft(id_t t, float max, id_t axis) {
-    return triangles[t].posFst[axis] <= max || triangles[t].posSnd[axis] <= max || triangles[t].posTrd[axis] <= max;
+// Triangles lying in the split plane go to both sides, ones touching it only to the side they extend into.
+void KDTree::classify(const BuildRef &ref, Split split, std::vector<BuildRef> &left, std::vector<BuildRef> &right) {
+    const float low = ref.min[split.axis];
+    const float high = ref.max[split.axis];
+    if (high < split.position || (high == split.position && low < high)) {
+        left.push_back(ref);
+        return;
+    }
+    if (low > split.position || (low == split.position && low < high)) {
+        right.push_back(ref);
+        return;
+    }
+    if (low == high) {
+        left.push_back(ref);
+        right.push_back(ref);
+        return;
+    }
+
+    // crossing the plane, each side gets the part of the triangle inside it, if there is one
+    BuildRef part = ref;
+    glm::vec3 boxMax = ref.max;
+    boxMax[split.axis] = split.position;
+    if (clip(part, boxMax, ref.min))
+        left.push_back(part);
+    part = ref;
+    glm::vec3 boxMin = ref.min;
+    boxMin[split.axis] = split.position;
+    if (clip(part, ref.max, boxMin))
+        right.push_back(part);
 }
 
-bool KDTree::inRight(id_t t, float min, id_t axis) {
-    return triangles[t].posFst[axis] >= min || triangles[t].posSnd[axis] >= min || triangles[t].posTrd[axis] >= min;
+KDTree::KDTree(Model &model, Scene &scene)
+    : Accelerator(model, scene), leafSize(scene.kdtreeLeafSize), traversalCost(scene.kdtreeTraversalCost),
+      intersectionCost(scene.kdtreeIntersectionCost), emptyBonus(scene.kdtreeEmptyBonus),
+      useMailbox(scene.mailbox) {
+    BuildTimes times = {extractTime, 0.f, 0.f, 0.f};
+    auto beginTime = std::chrono::high_resolution_clock::now();
+    auto lap = [&beginTime](float &time) {
+        const auto now = std::chrono::high_resolution_clock::now();
+        time = (now - beginTime).count() * 0.000000001f;
+        beginTime = now;
+    };
+
+    std::vector<BuildRef> refs(triangles.size());
+    for (id_t i = 0; i < triangles.size(); i++) {
+        refs[i].triangle = i;
+        refs[i].min = glm::min(glm::min(triangles[i].posFst, triangles[i].posSnd), triangles[i].posTrd);
+        refs[i].max = glm::max(glm::max(triangles[i].posFst, triangles[i].posSnd), triangles[i].posTrd);
+    }
+    lap(times.bounds);
+
+    BuildBuffer tree;
+    tree.nodes.resize(1);
+    KDNode root;
+#pragma omp parallel
+#pragma omp single
+    root = build(refs, maxCoords, minCoords, 8 + unsigned(1.3f * std::log2(triangles.size() + 1)), tree);
+    tree.nodes[0] = root;
+    nodes = std::move(tree.nodes);
+    lap(times.tree);
+
+    blocks.reserve(TriangleBlocks::blocksFor(tree.leafTriangles.size()) + nodes.size() / 2);
+    for (KDNode &node : nodes) {
+        if (node.isLeaf)
+            node.trianglesOffset =
+                blocks.pack(triangles, tree.leafTriangles.data() + node.trianglesOffset, node.child);
+    }
+    lap(times.pack);
+
+    if (!scene.kdtreeStats.empty())
+        report(scene, times);
 }
 
-bool lessThan(glm::vec3 &compare, glm::vec3 &to) { return compare.x < to.x || compare.y < to.y || compare.z < to.z; }
+KDTree::KDTree(Scene &scene)
+    : Accelerator(scene), leafSize(scene.kdtreeLeafSize), traversalCost(scene.kdtreeTraversalCost),
+      intersectionCost(scene.kdtreeIntersectionCost), emptyBonus(scene.kdtreeEmptyBonus),
+      useMailbox(scene.mailbox) {}
 
-bool greaterThan(glm::vec3 &compare, glm::vec3 &to) { return compare.x > to.x || compare.y > to.y || compare.z > to.z; }
+size_t KDTree::memoryUsage() { return nodes.size() * sizeof(KDNode) + blocks.memoryUsage(); }
 
-KDTree::KDTree(Model &model, Scene &scene)
-    : leafSize(scene.kdtreeLeafSize), minCoords(FLT_MAX, FLT_MAX, FLT_MAX), maxCoords(FLT_MIN, FLT_MIN, FLT_MIN) {
-    size_t indicesCount = 0;
+void KDTree::serialize(CacheFile &cache) {
+    Accelerator::serialize(cache);
+    cache.array(nodes);
+}
 
-    for (auto &mesh : model.meshes) {
-        indicesCount += mesh.indices.size();
+// The cost findSplit estimates, summed over the final tree: a node is entered with probability of its surface
+// relative to the root's, boxes of nodes are cut from the root's by the planes above them.
+float KDTree::sahCost() const {
+    auto surface = [](const glm::vec3 &min, const glm::vec3 &max) {
+        const glm::vec3 extent = max - min;
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    };
+    if (nodes.empty() || surface(minCoords, maxCoords) <= 0.f)
+        return 0.f;
+
+    struct {
+        id_t node;
+        glm::vec3 min, max;
+    } stack[stackSize];
+    unsigned stackTop = 0;
+    stack[stackTop++] = {0, minCoords, maxCoords};
+    float cost = 0.f;
+    while (stackTop) {
+        const auto entry = stack[--stackTop];
+        const KDNode &node = nodes[entry.node];
+        if (node.isLeaf) {
+            cost += surface(entry.min, entry.max) * intersectionCost * TriangleBlocks::blocksFor(node.child);
+            continue;
+        }
+        cost += surface(entry.min, entry.max) * traversalCost;
+        glm::vec3 leftMax = entry.max;
+        leftMax[node.axis] = node.split;
+        glm::vec3 rightMin = entry.min;
+        rightMin[node.axis] = node.split;
+        stack[stackTop++] = {id_t(node.child), entry.min, leftMax};
+        stack[stackTop++] = {id_t(node.child + 1), rightMin, entry.max};
     }
-    triangles.reserve((indicesCount + 2) / 3);
-    std::vector<id_t> triangleIDs((indicesCount + 2) / 3);
-
-    indicesCount = 0;
-    for (auto &mesh : model.meshes) {
-        const bool isLight = mesh.materialColor.emissive.r > 0.f || mesh.materialColor.emissive.g > 0.f ||
-                             mesh.materialColor.emissive.b > 0.f;
-
-        for (unsigned i = 0; i < mesh.indices.size(); i += 3) {
-            id_t triangleId = triangles.size();
-            triangles.push_back({.posFst = mesh.vertices[mesh.indices[i + 0]].Position,
-                                 .posSnd = mesh.vertices[mesh.indices[i + 1]].Position,
-                                 .posTrd = mesh.vertices[mesh.indices[i + 2]].Position});
-
-            materials.push_back({
-                .BRDFtype = isLight ? BRDFT::Emissive : BRDFT::Diffuse,
-
-                .normal = (mesh.vertices[mesh.indices[i + 0]].Normal + mesh.vertices[mesh.indices[i + 1]].Normal +
-                           mesh.vertices[mesh.indices[i + 2]].Normal) /
-                          3.f,
-
-                .Kd = mesh.materialColor.diffuse,
-                .Ke = mesh.materialColor.emissive,
-
-                .texDiffuse = mesh.textureDiffuse,
-
-                .texFst = mesh.vertices[mesh.indices[i + 0]].TexCoords,
-                .texSnd = mesh.vertices[mesh.indices[i + 1]].TexCoords,
-                .texTrd = mesh.vertices[mesh.indices[i + 2]].TexCoords,
-            });
-
-            if (isLight) {
-                float surface =
-                    0.5f * glm::length(glm::cross(triangles[triangleId].posSnd - triangles[triangleId].posFst,
-                                                  triangles[triangleId].posTrd - triangles[triangleId].posFst));
-                scene.lightTriangles.push_back(LightTriangle(triangleId, surface));
-            }
+    return cost / surface(minCoords, maxCoords);
+}
 
-            for (unsigned k = i; k < i + 3; k++) {
-                for (unsigned j = 0; j < 3; j++) {
-                    minCoords[j] = std::min(mesh.vertices[mesh.indices[k]].Position[j], minCoords[j]);
-                    maxCoords[j] = std::max(mesh.vertices[mesh.indices[k]].Position[j], maxCoords[j]);
-                }
-            }
-            triangleIDs[triangleId] = triangleId;
+/* Depths count from 0 at the root. Leaf sizes are binned by powers of two: bin 0 holds empty leaves and bin i leaves of
+ * 2^(i-1) up to 2^i - 1 triangles. */
+void KDTree::report(const Scene &scene, const BuildTimes &times) const {
+    std::vector<size_t> nodesAtDepth, leavesAtDepth, leafSizes;
+    size_t leaves = 0, emptyLeaves = 0, references = 0, maxLeafSize = 0, leafDepths = 0;
+    std::vector<std::pair<id_t, unsigned>> stack;
+    if (!nodes.empty())
+        stack.push_back({0, 0});
+    while (!stack.empty()) {
+        const id_t index = stack.back().first;
+        const unsigned depth = stack.back().second;
+        stack.pop_back();
+        const KDNode &node = nodes[index];
+        if (nodesAtDepth.size() <= depth) {
+            nodesAtDepth.resize(depth + 1, 0);
+            leavesAtDepth.resize(depth + 1, 0);
+        }
+        nodesAtDepth[depth]++;
+        if (!node.isLeaf) {
+            stack.push_back({id_t(node.child), depth + 1});
+            stack.push_back({id_t(node.child + 1), depth + 1});
+            continue;
         }
+        const size_t size = node.child;
+        leaves++;
+        leavesAtDepth[depth]++;
+        leafDepths += depth;
+        references += size;
+        maxLeafSize = std::max(maxLeafSize, size);
+        emptyLeaves += size == 0;
+        const size_t bin = size ? 1 + size_t(std::log2(size)) : 0;
+        if (leafSizes.size() <= bin)
+            leafSizes.resize(bin + 1, 0);
+        leafSizes[bin]++;
     }
 
-    nodes.push_back(KDTree::KDNode());
-    nodes[0] = build(triangleIDs, maxCoords, minCoords);
-    std::cout << "Triangles in scene: " << triangles.size() << "\n";
-    std::cout << "Surface Lights in scene:";
-    for (auto &light : scene.lightTriangles) {
-        std::cout << "\nTriangle {" << triangles[light.id].posFst << triangles[light.id].posSnd
-                  << triangles[light.id].posTrd << "} of radiance " << materials[light.id].Ke << " and surface "
-                  << light.surface;
+    const float averageLeafSize = leaves ? float(references) / leaves : 0.f;
+    const float averageFullLeafSize = leaves > emptyLeaves ? float(references) / (leaves - emptyLeaves) : 0.f;
+    const float averageLeafDepth = leaves ? float(leafDepths) / leaves : 0.f;
+    const float duplication = triangles.size() ? float(references) / triangles.size() : 0.f;
+    const size_t nodeMemory = nodes.size() * sizeof(KDNode);
+    const size_t shadingMemory =
+        shading.size() * sizeof(TriangleShading) + triangleTexCoords.size() * sizeof(TriangleTexCoords);
+    const float buildTime = times.extract + times.bounds + times.tree + times.pack;
+    auto list = [](std::ostream &out, const std::vector<size_t> &counts) {
+        for (size_t i = 0; i < counts.size(); i++)
+            out << (i ? ", " : "") << counts[i];
+    };
+
+    std::cout << "Kd-tree of " << nodes.size() << " nodes, " << leaves << " leaves of which " << emptyLeaves
+              << " are empty, " << nodesAtDepth.size() << " levels, leaves " << averageLeafDepth
+              << " deep on average.\n";
+    std::cout << "Leaves hold " << averageLeafSize << " triangles on average, " << averageFullLeafSize
+              << " when not empty, at most " << maxLeafSize << "; " << references << " references, "
+              << duplication << " per triangle.\n";
+    std::cout << "Nodes at every depth: ";
+    list(std::cout, nodesAtDepth);
+    std::cout << "\nLeaves at every depth: ";
+    list(std::cout, leavesAtDepth);
+    std::cout << "\nLeaves of 0, 1, 2-3, 4-7... triangles: ";
+    list(std::cout, leafSizes);
+    std::cout << "\nExpected SAH cost " << sahCost() << ", memory: nodes " << nodeMemory << ", triangle blocks "
+              << blocks.memoryUsage() << ", triangles " << triangles.memoryUsage() << ", shading " << shadingMemory
+              << ", materials " << materials.size() * sizeof(Material) << " bytes.\n";
+    std::cout << "Built in " << buildTime << " s: extracting " << times.extract << " s, bounds " << times.bounds
+              << " s, tree " << times.tree << " s, packing " << times.pack << " s.\n";
+
+    std::string model;
+    for (char c : scene.objPath) {
+        if (c == '"' || c == '\\')
+            model += '\\';
+        model += c;
     }
-    std::cout << (scene.lightTriangles.size() == 0 ? " None.\n" : "\n");
-    std::cout << "Point Lights in scene:";
-    for (auto &light : scene.lightPoints) {
-        std::cout << "\nPosition " << light.position << " of color " << light.color << " and intesity "
-                  << light.intensity;
-    }
-    std::cout << (scene.lightPoints.size() == 0 ? " None.\n" : "\n");
+    const std::string &path = scene.kdtreeStats;
+    std::ofstream json(path);
+    json << "{\n";
+    json << "  \"model\": \"" << model << "\",\n";
+    json << "  \"triangles\": " << triangles.size() << ",\n";
+    json << "  \"settings\": {\"leafSize\": " << leafSize << ", \"traversalCost\": " << traversalCost
+         << ", \"intersectionCost\": " << intersectionCost << ", \"emptyBonus\": " << emptyBonus
+         << ", \"blockSize\": " << TriangleBlocks::size << "},\n";
+    json << "  \"nodes\": " << nodes.size() << ",\n";
+    json << "  \"leaves\": " << leaves << ",\n";
+    json << "  \"emptyLeaves\": " << emptyLeaves << ",\n";
+    json << "  \"depth\": " << nodesAtDepth.size() << ",\n";
+    json << "  \"averageLeafDepth\": " << averageLeafDepth << ",\n";
+    json << "  \"nodesAtDepth\": [";
+    list(json, nodesAtDepth);
+    json << "],\n  \"leavesAtDepth\": [";
+    list(json, leavesAtDepth);
+    json << "],\n  \"leafSizeLog2Histogram\": [";
+    list(json, leafSizes);
+    json << "],\n";
+    json << "  \"averageLeafTriangles\": " << averageLeafSize << ",\n";
+    json << "  \"averageNonEmptyLeafTriangles\": " << averageFullLeafSize << ",\n";
+    json << "  \"maxLeafTriangles\": " << maxLeafSize << ",\n";
+    json << "  \"references\": " << references << ",\n";
+    json << "  \"referencesPerTriangle\": " << duplication << ",\n";
+    json << "  \"sahCost\": " << sahCost() << ",\n";
+    json << "  \"memoryBytes\": {\"nodes\": " << nodeMemory << ", \"triangleBlocks\": " << blocks.memoryUsage()
+         << ", \"triangles\": " << triangles.memoryUsage() << ", \"shading\": " << shadingMemory
+         << ", \"materials\": " << materials.size() * sizeof(Material) << "},\n";
+    json << "  \"buildSeconds\": {\"extract\": " << times.extract << ", \"bounds\": " << times.bounds
+         << ", \"tree\": " << times.tree << ", \"pack\": " << times.pack << ", \"total\": " << buildTime
+         << "}\n";
+    json << "}\n";
+    if (!json)
+        std::cerr << "Could not write kd-tree statistics to " << path << "\n";
+    else
+        std::cout << "Kd-tree statistics written to " << path << "\n";
+}
 
-    minCoords -= 0.0001f;
-    maxCoords += 0.0001f;
+// Runs f over [0, size) split into chunks, each chunk being a separate OpenMP task.
+template <typename F> static void forChunks(size_t size, F f) {
+    const size_t chunks = (size + KDTree::parallelChunkSize - 1) / KDTree::parallelChunkSize;
+#pragma omp taskloop grainsize(1)
+    for (size_t chunk = 0; chunk < chunks; chunk++)
+        f(chunk, chunk * KDTree::parallelChunkSize, std::min(size, (chunk + 1) * KDTree::parallelChunkSize));
 }
 
-KDTree::KDNode::Split KDTree::findSplit(std::vector<id_t> &tris, glm::vec3 &max, glm::vec3 &min) {
-    id_t bestAxis = 3; // if 3 is returned as axis then there's no point in splitting
+KDTree::Split KDTree::findSplit(std::vector<BuildRef> &refs, glm::vec3 &max, glm::vec3 &min, float &cost) {
+    id_t bestAxis = 3; // if 3 is returned as axis then there's no plane worth trying
     float bestSplit = 0.f;
-    float bestCost = float(tris.size());
-
-    for (id_t axis = 0; axis < 3; axis++) {
-        for (float ratio = 0.01f; ratio < 1.0f; ratio += 0.01f) {
-            float split = min[axis] + ratio * (max[axis] - min[axis]);
-            float cost = 0.f;
-            size_t leftCount = 0;
-            size_t rightCount = 0;
-
-            for (auto &tri : tris) {
-                if (inLeft(tri, split, axis)) {
-                    cost += ratio;
-                    leftCount++;
-                }
-                if (inRight(tri, split, axis)) {
-                    cost += (1.f - ratio);
-                    rightCount++;
+    cost = FLT_MAX;
+
+    const glm::vec3 extent = max - min;
+    const float invSurface = 1.f / (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    const glm::vec3 scale = float(binCount) / extent;
+
+    // one pass binning the clipped triangle bounds: minBins counts where triangles start, maxBins where they end
+    size_t minBins[3][binCount] = {{0}};
+    size_t maxBins[3][binCount] = {{0}};
+    auto bin = [&](size_t begin, size_t end, size_t(&minBins)[3][binCount], size_t(&maxBins)[3][binCount]) {
+        for (size_t i = begin; i < end; i++) {
+            for (id_t axis = 0; axis < 3; axis++) {
+                if (extent[axis] <= 0.f)
+                    continue;
+                const float low = (refs[i].min[axis] - min[axis]) * scale[axis];
+                const float high = (refs[i].max[axis] - min[axis]) * scale[axis];
+                minBins[axis][std::min(binCount - 1, unsigned(std::max(0.f, low)))]++;
+                maxBins[axis][std::min(binCount - 1, unsigned(std::max(0.f, high)))]++;
+            }
+        }
+    };
+    if (refs.size() < parallelChunkSize * 2) {
+        bin(0, refs.size(), minBins, maxBins);
+    } else {
+        forChunks(refs.size(), [&](size_t, size_t begin, size_t end) {
+            size_t chunkMinBins[3][binCount] = {{0}};
+            size_t chunkMaxBins[3][binCount] = {{0}};
+            bin(begin, end, chunkMinBins, chunkMaxBins);
+#pragma omp critical(kdtreeBins)
+            for (id_t axis = 0; axis < 3; axis++) {
+                for (unsigned i = 0; i < binCount; i++) {
+                    minBins[axis][i] += chunkMinBins[axis][i];
+                    maxBins[axis][i] += chunkMaxBins[axis][i];
                 }
             }
-            if (leftCount < tris.size() && rightCount < tris.size() && cost < bestCost) {
+        });
+    }
+
+    for (id_t axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0.f)
+            continue;
+
+        // one sweep over bin boundaries, triangles left of the plane grow as the ones on the right shrink
+        const id_t ax1 = (axis + 1) % 3;
+        const id_t ax2 = (axis + 2) % 3;
+        size_t leftCount = 0;
+        size_t rightCount = refs.size();
+        for (unsigned bin = 1; bin < binCount; bin++) {
+            leftCount += minBins[axis][bin - 1];
+            rightCount -= maxBins[axis][bin - 1];
+
+            const float split = min[axis] + bin * extent[axis] / binCount;
+            const float leftSurface = (split - min[axis]) * (extent[ax1] + extent[ax2]) + extent[ax1] * extent[ax2];
+            const float rightSurface = (max[axis] - split) * (extent[ax1] + extent[ax2]) + extent[ax1] * extent[ax2];
+            // a side with nothing in it is cheap to cut away, rays passing it only there leave the tree at once
+            const float bonus = (leftCount == 0 || rightCount == 0) ? 1.f - emptyBonus : 1.f;
+            const float splitCost = traversalCost + intersectionCost * bonus * invSurface *
+                                                        (leftSurface * TriangleBlocks::blocksFor(leftCount) +
+                                                         rightSurface * TriangleBlocks::blocksFor(rightCount));
+
+            // a plane keeping all triangles on one side is only worth it when the other one is empty
+            if (((leftCount < refs.size() && rightCount < refs.size()) || leftCount == 0 || rightCount == 0) &&
+                splitCost < cost) {
                 bestAxis = axis;
                 bestSplit = split;
-                bestCost = cost;
+                cost = splitCost;
             }
         }
     }
@@ -140,205 +373,338 @@ KDTree::KDNode::Split KDTree::findSplit(std::vector<id_t> &tris, glm::vec3 &max,
     return {bestAxis, bestSplit};
 }
 
-KDTree::KDNode KDTree::build(std::vector<id_t> &tris, glm::vec3 &max, glm::vec3 &min) {
-    KDTree::KDNode node;
-    if (tris.size() <= leafSize || (node.split = findSplit(tris, max, min)).axis == 3) {
-        node.isLeaf = true;
-        node.trianglesids = tris;
-        return node;
+void KDTree::partition(std::vector<BuildRef> &refs, Split split, std::vector<BuildRef> &left,
+                       std::vector<BuildRef> &right) {
+    if (refs.size() < parallelChunkSize * 2) {
+        for (auto &ref : refs)
+            classify(ref, split, left, right);
+        return;
     }
-    node.isLeaf = false;
-    node.child = nodes.size();
-    nodes.resize(nodes.size() + 2);
-    {
-        glm::vec3 min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
-        std::vector<id_t> childTriangles;
-        for (auto &tri : tris) {
-            if (inLeft(tri, node.split.position, node.split.axis)) {
-                childTriangles.push_back(tri);
-
-                min[node.split.axis] = std::min(min[node.split.axis], triMin(tri, node.split.axis));
-                max[node.split.axis] = std::max(max[node.split.axis], triMax(tri, node.split.axis));
-                id_t ax = (node.split.axis + 1) % 3;
-                min[ax] = std::min(min[ax], triMin(tri, ax));
-                max[ax] = std::max(max[ax], triMax(tri, ax));
-                ax = (ax + 1) % 3;
-                min[ax] = std::min(min[ax], triMin(tri, ax));
-                max[ax] = std::max(max[ax], triMax(tri, ax));
-            }
-        }
 
-        nodes[node.child] = build(childTriangles, max, min);
+    // partition chunks independently, then concatenate them in order
+    const size_t chunks = (refs.size() + parallelChunkSize - 1) / parallelChunkSize;
+    std::vector<std::vector<BuildRef>> chunkLeft(chunks), chunkRight(chunks);
+    forChunks(refs.size(), [&](size_t chunk, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            classify(refs[i], split, chunkLeft[chunk], chunkRight[chunk]);
+    });
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        left.insert(left.end(), chunkLeft[chunk].begin(), chunkLeft[chunk].end());
+        right.insert(right.end(), chunkRight[chunk].begin(), chunkRight[chunk].end());
     }
-    {
-        glm::vec3 min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
-        std::vector<id_t> childTriangles;
-        for (auto &tri : tris) {
-            if (inRight(tri, node.split.position, node.split.axis)) {
-                childTriangles.push_back(tri);
-
-                min[node.split.axis] = std::min(min[node.split.axis], triMin(tri, node.split.axis));
-                max[node.split.axis] = std::max(max[node.split.axis], triMax(tri, node.split.axis));
-                id_t ax = (node.split.axis + 1) % 3;
-                min[ax] = std::min(min[ax], triMin(tri, ax));
-                max[ax] = std::max(max[ax], triMax(tri, ax));
-                ax = (ax + 1) % 3;
-                min[ax] = std::min(min[ax], triMin(tri, ax));
-                max[ax] = std::max(max[ax], triMax(tri, ax));
-            }
-        }
-        nodes[node.child + 1] = build(childTriangles, max, min);
-    }
-
-    return node;
 }
 
-std::pair<float, float> intersectRayBox(const glm::vec3 &origin, const glm::vec3 &dir, glm::vec3 &max, glm::vec3 &min) {
-    const float dirinvy = 1.f / dir.y;
-    const float dirinvx = 1.f / dir.x;
-    const float dirinvz = 1.f / dir.z;
-    const float txmin = (min.x - origin.x) * dirinvx;
-    const float txmax = (max.x - origin.x) * dirinvx;
-    const float tymin = (min.y - origin.y) * dirinvy;
-    const float tymax = (max.y - origin.y) * dirinvy;
-    const float tzmin = (min.z - origin.z) * dirinvz;
-    const float tzmax = (max.z - origin.z) * dirinvz;
-    return {std::max(std::max(std::min(txmin, txmax), std::min(tymin, tymax)), std::min(tzmin, tzmax)),
-            std::min(std::min(std::max(txmin, txmax), std::max(tymin, tymax)), std::max(tzmin, tzmax))};
+// Moves a subtree built into its own buffer to the end of the parent's and returns its root pointing at the new place.
+KDTree::KDNode KDTree::stitch(BuildBuffer &buffer, KDNode root, BuildBuffer &subtree) {
+    const id_t nodesOffset = buffer.nodes.size();
+    const id_t trianglesOffset = buffer.leafTriangles.size();
+    for (auto node : subtree.nodes) {
+        if (node.isLeaf)
+            node.trianglesOffset += trianglesOffset;
+        else
+            node.child += nodesOffset;
+        buffer.nodes.push_back(node);
+    }
+    buffer.leafTriangles.insert(buffer.leafTriangles.end(), subtree.leafTriangles.begin(),
+                                subtree.leafTriangles.end());
+    if (root.isLeaf)
+        root.trianglesOffset += trianglesOffset;
+    else
+        root.child += nodesOffset;
+    return root;
 }
 
-bool KDTree::intersectRay(const glm::vec3 &origin, const glm::vec3 &dir, id_t &triangle, glm::vec2 &baryPosition,
-                          float &distance) {
-    auto intersect = intersectRayBox(origin, dir, maxCoords, minCoords);
-    if (intersect.second < 0 || intersect.second < intersect.first)
-        return false;
-    return intersectRayNode(origin, dir, triangle, baryPosition, distance, nodes[0], intersect.first, intersect.second);
+KDTree::KDNode KDTree::makeLeaf(std::vector<BuildRef> &refs, BuildBuffer &buffer) {
+    KDTree::KDNode node;
+    node.isLeaf = true;
+    node.axis = 3;
+    node.trianglesOffset = buffer.leafTriangles.size();
+    node.child = refs.size();
+    for (auto &ref : refs)
+        buffer.leafTriangles.push_back(ref.triangle);
+    return node;
 }
 
-/* based off original Möller–Trumbore algorithm */
-bool KDTree::intersectRayTriangle(const glm::vec3 &origin, const glm::vec3 &dir, const id_t tri,
-                                  glm::vec2 &baryPosition, float &distance) {
-    const glm::vec3 v0 = triangles[tri].posFst;
-    const glm::vec3 e1 = triangles[tri].posSnd - v0;
-    const glm::vec3 e2 = triangles[tri].posTrd - v0;
-
-    const glm::vec3 p = glm::cross(dir, e2);
-
-    const float a = glm::dot(e1, p);
-
-    const float Epsilon = std::numeric_limits<float>::epsilon();
-    if (a < Epsilon && a > -Epsilon)
-        return false;
-
-    const float f = 1.f / a;
-
-    const glm::vec3 s = origin - v0;
-    baryPosition.x = f * glm::dot(s, p);
-    if (baryPosition.x < 0.f || baryPosition.x > 1.f)
-        return false;
+KDTree::KDNode KDTree::build(std::vector<BuildRef> &refs, glm::vec3 &max, glm::vec3 &min, unsigned depth,
+                             BuildBuffer &buffer) {
+    Split split;
+    float splitCost;
+    // The SAH decides when to stop, the leaf size is only a fallback for nodes it would leave oversized.
+    if (refs.size() <= 1 || depth == 0 || (split = findSplit(refs, max, min, splitCost)).axis == 3 ||
+        (splitCost >= intersectionCost * TriangleBlocks::blocksFor(refs.size()) && refs.size() <= leafSize))
+        return makeLeaf(refs, buffer);
+
+    std::vector<BuildRef> leftRefs, rightRefs;
+    partition(refs, split, leftRefs, rightRefs);
+    // binning is only an estimate, don't recurse when the plane separates nothing
+    if (leftRefs.size() == refs.size() && rightRefs.size() == refs.size())
+        return makeLeaf(refs, buffer);
+    // the children have their own copies, free this one before going deeper
+    const size_t count = refs.size();
+    std::vector<BuildRef>().swap(refs);
+
+    glm::vec3 leftMax = max;
+    leftMax[split.axis] = split.position;
+    glm::vec3 rightMin = min;
+    rightMin[split.axis] = split.position;
 
-    const glm::vec3 q = glm::cross(s, e1);
-    baryPosition.y = f * glm::dot(dir, q);
-    if (baryPosition.y < 0.f || baryPosition.y + baryPosition.x > 1.f)
-        return false;
+    KDTree::KDNode node;
+    node.isLeaf = false;
+    node.axis = split.axis;
+    node.split = split.position;
+    KDNode left, right;
+    if (count < parallelBuildSize) {
+        node.child = buffer.nodes.size();
+        buffer.nodes.resize(buffer.nodes.size() + 2);
+        left = build(leftRefs, leftMax, min, depth - 1, buffer);
+        right = build(rightRefs, max, rightMin, depth - 1, buffer);
+    } else {
+        // big subtrees are built as independent tasks into their own buffers and stitched together afterwards
+        BuildBuffer leftBuffer, rightBuffer;
+#pragma omp task shared(left, leftRefs, leftMax, leftBuffer)
+        left = build(leftRefs, leftMax, min, depth - 1, leftBuffer);
+        right = build(rightRefs, max, rightMin, depth - 1, rightBuffer);
+#pragma omp taskwait
+
+        node.child = buffer.nodes.size();
+        buffer.nodes.resize(buffer.nodes.size() + 2);
+        left = stitch(buffer, left, leftBuffer);
+        right = stitch(buffer, right, rightBuffer);
+    }
+    buffer.nodes[node.child] = left;
+    buffer.nodes[node.child + 1] = right;
 
-    return (distance = f * glm::dot(e2, q)) >= 0.f;
+    return node;
 }
 
-bool KDTree::intersectRayNode(const glm::vec3 &origin, const glm::vec3 &dir, id_t &triangle, glm::vec2 &baryPosition,
-                              float &distance, KDTree::KDNode &node, float tmin, float tmax) {
-    if (node.isLeaf) {
-        glm::vec2 bPos;
-        bool ret = false;
-        float dist;
-        for (auto &tri : node.trianglesids) {
-            if (intersectRayTriangle(origin, dir, tri, bPos, dist) && dist < tmax) {
-                baryPosition = bPos;
-                tmax = dist;
-                triangle = tri;
-                ret = true;
+/* Front to back traversal of the nodes overlapping [tmin, tmax] without recursion. For every leaf reached
+ * leafTest(leaf, tmax) is called with the end of the ray segment inside it, returning true stops the traversal. */
+template <typename LeafTest> bool KDTree::traverse(const Ray &ray, float tmin, float tmax, LeafTest leafTest) {
+    struct {
+        id_t node;
+        float tmin, tmax;
+    } stack[stackSize];
+    unsigned stackTop = 0;
+    uint64_t visits = 0;
+    const KDNode *node = &nodes[0];
+
+    while (true) {
+        visits++;
+        while (!node->isLeaf) {
+            const id_t axis = node->axis;
+            const float tsplit = (node->split - ray.origin[axis]) * ray.invDir[axis];
+            // on the plane itself the ray goes first where it points to
+            const id_t belowFirst =
+                ray.origin[axis] < node->split || (ray.origin[axis] == node->split && ray.sign[axis]);
+            const id_t near = node->child + (1 - belowFirst);
+            const id_t far = node->child + belowFirst;
+
+            if (tsplit >= tmax || tsplit < 0)
+                node = &nodes[near];
+            else if (tsplit <= tmin)
+                node = &nodes[far];
+            else {
+                stack[stackTop++] = {far, tsplit, tmax};
+                node = &nodes[near];
+                tmax = tsplit;
             }
+            visits++;
         }
-        distance = tmax;
-        return ret;
-    }
-
-    const float tsplit = (node.split.position - origin[node.split.axis]) / dir[node.split.axis];
-    const id_t belowFirst = (origin[node.split.axis] < node.split.position) ||
-                            (origin[node.split.axis] == node.split.position && dir[node.split.axis] <= 0);
 
-    if (tsplit >= tmax || tsplit < 0)
-        return intersectRayNode(origin, dir, triangle, baryPosition, distance, nodes[node.child + (1 - belowFirst)],
-                                tmin, tmax);
-    else if (tsplit <= tmin)
-        return intersectRayNode(origin, dir, triangle, baryPosition, distance, nodes[node.child + belowFirst], tmin,
-                                tmax);
-    else
-        return intersectRayNode(origin, dir, triangle, baryPosition, distance, nodes[node.child + (1 - belowFirst)],
-                                tmin, tsplit) ||
-               intersectRayNode(origin, dir, triangle, baryPosition, distance, nodes[node.child + belowFirst], tsplit,
-                                tmax);
+        if (leafTest(*node, tmax)) {
+            Stats::add(Stats::NodeVisits, visits);
+            return true;
+        }
+        if (stackTop == 0)
+            break;
+        stackTop--;
+        node = &nodes[stack[stackTop].node];
+        tmin = stack[stackTop].tmin;
+        tmax = stack[stackTop].tmax;
+    }
+    Stats::add(Stats::NodeVisits, visits);
+    return false;
 }
 
-bool KDTree::intersectShadowRay(const glm::vec3 &origin, const glm::vec3 &dir, const float distance,
-                                const id_t lightTriangle) {
-    auto intersect = intersectRayBox(origin, dir, maxCoords, minCoords);
-    if (intersect.second < 0 || intersect.second < intersect.first || intersect.first > distance)
+bool KDTree::intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) {
+    Stats::add(Stats::Rays, 1);
+    distance = ray.tfar;
+    auto intersect = intersectRayBox(ray, maxCoords, minCoords);
+    intersect.first = std::max(intersect.first, ray.tnear);
+    intersect.second = std::min(intersect.second, ray.tfar);
+    if (intersect.second < intersect.first)
         return false;
-    return intersectShadowRayNode(origin, dir, lightTriangle, nodes[0], intersect.first,
-                                  std::min(intersect.second, distance));
-}
-
-// pretty much the same as intersectRayTriangle
-bool KDTree::intersectShadowRayTriangle(const glm::vec3 &origin, const glm::vec3 &dir, const id_t tri,
-                                        const float tmax) {
-    const glm::vec3 v0 = triangles[tri].posFst;
-    const glm::vec3 e1 = triangles[tri].posSnd - v0;
-    const glm::vec3 e2 = triangles[tri].posTrd - v0;
-
-    const glm::vec3 p = glm::cross(dir, e2);
 
-    const float a = glm::dot(e1, p);
+    bool found = false;
+    Mailbox *mailbox = useMailbox ? &Mailbox::forRay() : nullptr;
+    auto closestHit = [&](const KDNode &leaf, float tmax) {
+        found |=
+            blocks.intersectRay(ray, leaf.trianglesOffset, leaf.child, triangle, baryPosition, distance, mailbox);
+        // leaves come front to back, so the rest lies behind a hit inside this one
+        return found && distance <= tmax;
+    };
+    traverse(ray, intersect.first, intersect.second, closestHit);
+    return found;
+}
 
-    const float Epsilon = std::numeric_limits<float>::epsilon();
-    if (a < Epsilon && a > -Epsilon)
-        return false;
+/* All rays of the packet step through the tree together, each with its own [tmin, tmax] segment, and only split
+ * apart to be tested against the triangles of a leaf. As the rays share their origin, the child containing it comes
+ * first for all of them. Bounds of the packet's directions and segments often settle which children it enters
+ * without looking at single rays. */
+void KDTree::intersectPacket(RayPacket &packet) {
+    constexpr unsigned size = RayPacket::size;
+    Stats::add(Stats::Rays, packet.count);
+    const glm::vec3 &origin = packet.origin;
+
+    Ray rays[size];
+    float dirs[3][size], invDirs[3][size];
+    float tmin[size], tmax[size];
+    // interval of inverse directions, valid for an axis when all of them point the same way along it
+    glm::vec3 invLow(FLT_MAX), invHigh(-FLT_MAX);
+    bool positive[3] = {true, true, true}, negative[3] = {true, true, true};
+    float packetMin = FLT_MAX, packetMax = -FLT_MAX;
+    for (unsigned i = 0; i < size; i++) {
+        packet.hit[i] = false;
+        packet.distance[i] = FLT_MAX;
+        tmin[i] = FLT_MAX;
+        tmax[i] = -FLT_MAX;
+        rays[i] = Ray(origin, i < packet.count ? packet.dir[i] : glm::vec3(1.f));
+        for (id_t axis = 0; axis < 3; axis++) {
+            dirs[axis][i] = rays[i].dir[axis];
+            invDirs[axis][i] = rays[i].invDir[axis];
+        }
+        if (i >= packet.count)
+            continue;
+
+        auto intersect = intersectRayBox(rays[i], maxCoords, minCoords);
+        if (intersect.second < 0 || intersect.second < intersect.first)
+            continue;
+        tmin[i] = intersect.first;
+        tmax[i] = intersect.second;
+        packetMin = std::min(packetMin, tmin[i]);
+        packetMax = std::max(packetMax, tmax[i]);
+        invLow = glm::min(invLow, glm::vec3(invDirs[0][i], invDirs[1][i], invDirs[2][i]));
+        invHigh = glm::max(invHigh, glm::vec3(invDirs[0][i], invDirs[1][i], invDirs[2][i]));
+        for (id_t axis = 0; axis < 3; axis++) {
+            positive[axis] &= dirs[axis][i] > 0.f;
+            negative[axis] &= dirs[axis][i] < 0.f;
+        }
+    }
+    if (packetMin > packetMax)
+        return;
+
+    struct Entry {
+        id_t node;
+        float packetMin, packetMax;
+        float tmin[size], tmax[size];
+    };
+    Entry stack[stackSize];
+    unsigned stackTop = 0;
+    uint64_t visits = 0;
+    const KDNode *node = &nodes[0];
+
+    while (true) {
+        visits++;
+        while (!node->isLeaf) {
+            const id_t axis = node->axis;
+            const float toSplit = node->split - origin[axis];
+            // on the plane itself the child below comes first, rays going down never reach the other one
+            const id_t near = node->child + (toSplit < 0.f);
+            const id_t far = node->child + (toSplit >= 0.f);
+            const bool allTowardFar = toSplit >= 0.f ? positive[axis] : negative[axis];
+            const bool noneTowardFar = toSplit >= 0.f ? negative[axis] : positive[axis];
+            visits++;
+
+            // whole packet on one side, the segments stay as they were
+            if (noneTowardFar) {
+                node = &nodes[near];
+                continue;
+            }
+            if (allTowardFar) {
+                const float low = toSplit * (toSplit >= 0.f ? invLow[axis] : invHigh[axis]);
+                const float high = toSplit * (toSplit >= 0.f ? invHigh[axis] : invLow[axis]);
+                if (low >= packetMax) {
+                    node = &nodes[near];
+                    continue;
+                }
+                if (high <= packetMin) {
+                    node = &nodes[far];
+                    continue;
+                }
+            }
 
-    const float f = 1.f / a;
+            // segments of every ray before and behind the plane
+            float nearMax[size], farMin[size];
+            float nearHigh = -FLT_MAX, farLow = FLT_MAX;
+            unsigned anyNear = 0, anyFar = 0;
+            for (unsigned i = 0; i < size; i++) {
+                const bool towardFar = toSplit >= 0.f ? dirs[axis][i] > 0.f : dirs[axis][i] < 0.f;
+                const float tsplit = towardFar ? std::max(toSplit * invDirs[axis][i], 0.f) : FLT_MAX;
+                const float end = std::min(tmax[i], packet.distance[i]);
+                nearMax[i] = std::min(tmax[i], tsplit);
+                farMin[i] = std::max(tmin[i], tsplit);
+                anyNear |= tmin[i] <= std::min(nearMax[i], end);
+                anyFar |= farMin[i] <= end;
+                nearHigh = std::max(nearHigh, nearMax[i]);
+                farLow = std::min(farLow, farMin[i]);
+            }
 
-    const glm::vec3 s = origin - v0;
-    const float baryPositionx = f * glm::dot(s, p);
-    if (baryPositionx < 0.f || baryPositionx > 1.f)
-        return false;
+            if (anyFar) {
+                if (!anyNear) {
+                    std::copy(farMin, farMin + size, tmin);
+                    packetMin = farLow;
+                    node = &nodes[far];
+                    continue;
+                }
+                Entry &entry = stack[stackTop++];
+                entry.node = far;
+                entry.packetMin = farLow;
+                entry.packetMax = packetMax;
+                std::copy(farMin, farMin + size, entry.tmin);
+                std::copy(tmax, tmax + size, entry.tmax);
+            }
+            std::copy(nearMax, nearMax + size, tmax);
+            packetMax = nearHigh;
+            node = &nodes[near];
+        }
 
-    const glm::vec3 q = glm::cross(s, e1);
-    const float baryPositiony = f * glm::dot(dir, q);
-    if (baryPositiony < 0.f || baryPositiony + baryPositionx > 1.f)
-        return false;
-    const float t = (f * glm::dot(e2, q));
-    return t >= 0.f && t < tmax;
-}
+        // rays part only here, a ray which hits something inside its segment is done as the rest lies behind
+        for (unsigned i = 0; i < packet.count; i++) {
+            if (tmin[i] <= std::min(tmax[i], packet.distance[i]))
+                packet.hit[i] |= blocks.intersectRay(rays[i], node->trianglesOffset, node->child,
+                                                     packet.triangle[i], packet.baryPosition[i], packet.distance[i]);
+        }
 
-bool KDTree::intersectShadowRayNode(const glm::vec3 &origin, const glm::vec3 &dir, const id_t lightTriangle,
-                                    KDTree::KDNode &node, float tmin, float tmax) {
-    if (node.isLeaf) {
-        for (auto &tri : node.trianglesids) {
-            if (tri != lightTriangle && intersectShadowRayTriangle(origin, dir, tri, tmax)) {
-                return true;
-            }
+        // skip waiting children which no ray needs anymore
+        bool active = false;
+        while (!active && stackTop) {
+            const Entry &entry = stack[--stackTop];
+            for (unsigned i = 0; i < packet.count; i++)
+                active |= entry.tmin[i] <= std::min(entry.tmax[i], packet.distance[i]);
         }
-        return false;
+        if (!active)
+            break;
+        const Entry &entry = stack[stackTop];
+        node = &nodes[entry.node];
+        packetMin = entry.packetMin;
+        packetMax = entry.packetMax;
+        std::copy(entry.tmin, entry.tmin + size, tmin);
+        std::copy(entry.tmax, entry.tmax + size, tmax);
     }
+    Stats::add(Stats::NodeVisits, visits);
+}
 
-    const float tsplit = (node.split.position - origin[node.split.axis]) / dir[node.split.axis];
-    const id_t belowFirst = (origin[node.split.axis] < node.split.position) ||
-                            (origin[node.split.axis] == node.split.position && dir[node.split.axis] <= 0);
+bool KDTree::intersectShadowRay(const Ray &ray, const id_t lightTriangle) {
+    Stats::add(Stats::ShadowRays, 1);
+    auto intersect = intersectRayBox(ray, maxCoords, minCoords);
+    intersect.first = std::max(intersect.first, ray.tnear);
+    intersect.second = std::min(intersect.second, ray.tfar);
+    if (intersect.second < intersect.first)
+        return false;
 
-    if (tsplit >= tmax || tsplit < 0)
-        return intersectShadowRayNode(origin, dir, lightTriangle, nodes[node.child + (1 - belowFirst)], tmin, tmax);
-    else if (tsplit <= tmin)
-        return intersectShadowRayNode(origin, dir, lightTriangle, nodes[node.child + belowFirst], tmin, tmax);
-    else
-        return intersectShadowRayNode(origin, dir, lightTriangle, nodes[node.child + (1 - belowFirst)], tmin, tsplit) ||
-               intersectShadowRayNode(origin, dir, lightTriangle, nodes[node.child + belowFirst], tsplit, tmax);
+    Mailbox *mailbox = useMailbox ? &Mailbox::forRay() : nullptr;
+    auto anyHit = [&](const KDNode &leaf, float) {
+        return blocks.intersectShadowRay(ray, leaf.trianglesOffset, leaf.child, lightTriangle, mailbox);
+    };
+    return traverse(ray, intersect.first, intersect.second, anyHit);
 }
@@ -6,16 +6,19 @@
 #include "shader.hpp"
 
 #include <glad/glad.h>
+#include <utility>
 
 Mesh::Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures,
            Color materialColor) {
-    this->vertices = vertices;
-    this->indices = indices;
-    this->textures = textures;
+    this->vertices = std::move(vertices);
+    this->indices = std::move(indices);
+    this->textures = std::move(textures);
     this->materialColor = materialColor;
     setupMesh();
 }
 
+void Mesh::releaseVertices() { std::vector<Vertex>().swap(vertices); }
+
 bool Mesh::hasTexture() { return textureNormal || textureHeight || textureDiffuse || textureSpecular; }
 
 glm::vec3 Texture::getColorAt(glm::vec2 coords) {
@@ -9,6 +9,7 @@
 
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
+#include <glm/gtc/type_ptr.hpp>
 #include <iostream>
 #include <stb_image.h>
 
@@ -19,7 +20,18 @@ Model::Model(Scene &scene) {
 }
 
 void Model::Draw(Shader shaderTexture, Shader shaderMaterial) {
-    for (auto &mesh : meshes)  mesh.Draw(shaderTexture, shaderMaterial);
+    for (auto &instance : instances) {
+        shaderTexture.use();
+        shaderTexture.setMat4("model", instance.transform);
+        shaderMaterial.use();
+        shaderMaterial.setMat4("model", instance.transform);
+        meshes[instance.mesh].Draw(shaderTexture, shaderMaterial);
+    }
+}
+
+void Model::releaseVertices() {
+    for (auto &mesh : meshes)
+        mesh.releaseVertices();
 }
 
 void Model::loadModel(std::string path) {
@@ -32,18 +44,27 @@ void Model::loadModel(std::string path) {
     }
     directory = path.substr(0, path.find_last_of('/'));
 
-    processNode(scene->mRootNode, scene);
+    std::vector<int> loaded(scene->mNumMeshes, -1);
+    processNode(scene->mRootNode, scene, glm::mat4(1.f), loaded);
 }
 
-void Model::processNode(aiNode *node, const aiScene *scene) {
-    // process all the node's meshes
+void Model::processNode(aiNode *node, const aiScene *scene, const glm::mat4 &parentTransform,
+                        std::vector<int> &loaded) {
+    // assimp matrices are row major
+    const glm::mat4 transform = parentTransform * glm::transpose(glm::make_mat4(&node->mTransformation.a1));
+
+    // process all the node's meshes, each one only the first time it is used
     for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-        aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-        meshes.push_back(processMesh(mesh, scene));
+        const unsigned int index = node->mMeshes[i];
+        if (loaded[index] < 0) {
+            loaded[index] = meshes.size();
+            meshes.push_back(processMesh(scene->mMeshes[index], scene));
+        }
+        instances.push_back({unsigned(loaded[index]), transform});
     }
     // process all the children's meshes
     for (unsigned int i = 0; i < node->mNumChildren; i++) {
-        processNode(node->mChildren[i], scene);
+        processNode(node->mChildren[i], scene, transform, loaded);
     }
 }
 
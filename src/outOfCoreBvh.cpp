@@ -0,0 +1,315 @@
+#include "outOfCoreBvh.hpp"
+#include "cacheFile.hpp"
+#include "model.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+static float surface(const Triangle &triangle) {
+    return 0.5f * glm::length(glm::cross(triangle.posSnd - triangle.posFst, triangle.posTrd - triangle.posFst));
+}
+
+/* Triangles of the whole model are extracted once, in memory, to be split and written to the chunk file. The copy is
+ * dropped afterwards, rendering only needs the chunks it pages in. */
+OutOfCoreBVH::OutOfCoreBVH(Model &model, Scene &scene, uint64_t key)
+    : Accelerator(model, scene), scene(scene), chunkPath(scene.objPath + ".chunks"), chunkKey(key), pageIns(0) {
+    std::vector<glm::vec3> centroids(triangles.size());
+    std::vector<id_t> order(triangles.size());
+#pragma omp parallel for
+    for (id_t i = 0; i < triangles.size(); i++) {
+        const Triangle tri = triangles[i];
+        centroids[i] = (tri.posFst + tri.posSnd + tri.posTrd) / 3.f;
+        order[i] = i;
+    }
+    nodes.reserve(2 * (triangles.size() / std::max(scene.chunkTriangles, 1u) + 1));
+    if (triangles.size())
+        partition(order, centroids, 0, order.size(), stackSize - 1);
+
+    // ids go chunk by chunk from now on
+    std::vector<id_t> chunkIds(order.size());
+    for (id_t i = 0; i < order.size(); i++)
+        chunkIds[order[i]] = i;
+    std::vector<id_t> lightIds;
+    for (auto &light : scene.lightTriangles) {
+        light.id = chunkIds[light.id];
+        lightIds.push_back(light.id);
+    }
+    lights = std::move(lightIds);
+
+    writeChunks(order);
+    triangles.clear();
+    shading.clear();
+    triangleTexCoords.clear();
+    std::cout << "Out-of-core BVH split " << order.size() << " triangles into " << chunks.size() << " chunks, "
+              << scene.chunkBudget / 1048576 << " MB of them are kept in memory.\n";
+}
+
+OutOfCoreBVH::OutOfCoreBVH(Scene &scene, uint64_t key)
+    : Accelerator(scene), scene(scene), chunkPath(scene.objPath + ".chunks"), chunkKey(key), pageIns(0) {}
+
+// trees view the chunk file, they go first
+OutOfCoreBVH::~OutOfCoreBVH() { trees.clear(); }
+
+id_t OutOfCoreBVH::partition(std::vector<id_t> &order, const std::vector<glm::vec3> &centroids, size_t begin,
+                             size_t end, unsigned depth) {
+    const id_t index = nodes.size();
+    nodes.push_back({});
+    glm::vec3 min(FLT_MAX), max(-FLT_MAX), centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+    for (size_t i = begin; i < end; i++) {
+        const Triangle tri = triangles[order[i]];
+        min = glm::min(min, glm::min(glm::min(tri.posFst, tri.posSnd), tri.posTrd));
+        max = glm::max(max, glm::max(glm::max(tri.posFst, tri.posSnd), tri.posTrd));
+        centroidMin = glm::min(centroidMin, centroids[order[i]]);
+        centroidMax = glm::max(centroidMax, centroids[order[i]]);
+    }
+    nodes[index].min = min;
+    nodes[index].max = max;
+
+    const id_t count = end - begin;
+    if (count <= scene.chunkTriangles || depth == 0) {
+        // a leaf holds exactly one chunk
+        nodes[index].offset = chunks.size();
+        nodes[index].count = 1;
+        chunks.push_back({min, id_t(begin), max, count});
+        return index;
+    }
+
+    const glm::vec3 extent = centroidMax - centroidMin;
+    const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    const size_t middle = begin + count / 2;
+    std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                     [&](id_t a, id_t b) { return centroids[a][axis] < centroids[b][axis]; });
+
+    nodes[index].count = 0;
+    partition(order, centroids, begin, middle, depth - 1);
+    const id_t right = partition(order, centroids, middle, end, depth - 1);
+    nodes[index].offset = right;
+    return index;
+}
+
+void OutOfCoreBVH::writeChunks(const std::vector<id_t> &order) {
+    CacheFile file(chunkPath, chunkKey);
+    // an older file of the same model is written over
+    file.discard();
+    uint64_t chunkCount = chunks.size();
+    file.value(chunkCount);
+    for (const Chunk &chunk : chunks) {
+        const std::vector<id_t> ids(order.begin() + chunk.firstTriangle,
+                                    order.begin() + chunk.firstTriangle + chunk.triangleCount);
+        ChunkTree tree(*this, ids, scene);
+        file.page();
+        tree.serialize(file);
+    }
+    if (!file.save() || !mapChunks())
+        std::cerr << "Could not write chunk file " << chunkPath << "\n";
+}
+
+bool OutOfCoreBVH::mapChunks() {
+    trees.clear();
+    ranges.clear();
+    chunkFile.reset(new CacheFile(chunkPath, chunkKey));
+    if (!chunkFile->loaded())
+        return false;
+    uint64_t chunkCount = 0;
+    chunkFile->value(chunkCount);
+    if (chunkCount != chunks.size())
+        return false;
+    for (const Chunk &chunk : chunks) {
+        const size_t begin = chunkFile->page();
+        trees.emplace_back(new ChunkTree(scene));
+        trees.back()->serialize(*chunkFile);
+        ranges.emplace_back(begin, chunkFile->position());
+        if (!chunkFile->good() || trees.back()->triangles.size() != chunk.triangleCount)
+            return false;
+    }
+
+    // what mapping the trees read in is dropped, chunks are paged in once rays reach them
+    residency.reset(new Residency[chunks.size()]);
+    for (id_t i = 0; i < chunks.size(); i++) {
+        residency[i].resident = false;
+        residency[i].lastUse = 0;
+        chunkFile->advise(ranges[i].first, ranges[i].second, false);
+    }
+    residentBytes = 0;
+    return true;
+}
+
+OutOfCoreBVH::ChunkTree &OutOfCoreBVH::tree(id_t chunk) const {
+    Residency &state = residency[chunk];
+    if (!state.resident.load(std::memory_order_acquire))
+        pageIn(chunk);
+    // written only when it changes, so chunks used all the time don't bounce between caches of the threads
+    const uint64_t now = pageIns.load(std::memory_order_relaxed);
+    if (state.lastUse.load(std::memory_order_relaxed) != now)
+        state.lastUse.store(now, std::memory_order_relaxed);
+    return *trees[chunk];
+}
+
+/* Mapped pages of the file are never written, so dropping them is safe even while another thread still traverses the
+ * evicted chunk: the kernel reads them from the file again. Counting stays exact as it is done under a lock. */
+void OutOfCoreBVH::pageIn(id_t chunk) const {
+#pragma omp critical(outOfCorePaging)
+    {
+        Residency &state = residency[chunk];
+        if (!state.resident.load(std::memory_order_relaxed)) {
+            chunkFile->advise(ranges[chunk].first, ranges[chunk].second, true);
+            residentBytes += ranges[chunk].second - ranges[chunk].first;
+            state.lastUse.store(pageIns.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            state.resident.store(true, std::memory_order_release);
+            Stats::add(Stats::ChunkPageIns, 1);
+
+            // chunks are not many, the least recently used one is looked for among all
+            while (residentBytes > scene.chunkBudget) {
+                id_t oldest = id_t(-1);
+                for (id_t i = 0; i < chunks.size(); i++) {
+                    if (i != chunk && residency[i].resident.load(std::memory_order_relaxed) &&
+                        (oldest == id_t(-1) || residency[i].lastUse.load(std::memory_order_relaxed) <
+                                                   residency[oldest].lastUse.load(std::memory_order_relaxed)))
+                        oldest = i;
+                }
+                if (oldest == id_t(-1))
+                    break;
+                residency[oldest].resident.store(false, std::memory_order_relaxed);
+                chunkFile->advise(ranges[oldest].first, ranges[oldest].second, false);
+                residentBytes -= ranges[oldest].second - ranges[oldest].first;
+                Stats::add(Stats::ChunkEvictions, 1);
+            }
+        }
+    }
+}
+
+size_t OutOfCoreBVH::memoryUsage() {
+    return nodes.size() * sizeof(BVHNode) + chunks.size() * sizeof(Chunk) + residentBytes;
+}
+
+void OutOfCoreBVH::serialize(CacheFile &cache) {
+    Accelerator::serialize(cache);
+    cache.array(chunks);
+    cache.array(nodes);
+    cache.array(lights);
+    if (cache.loaded() && cache.good() && !mapChunks())
+        trees.clear();
+}
+
+bool OutOfCoreBVH::linkModel(Model &model, Scene &scene) {
+    size_t triangleCount = 0;
+    for (auto &instance : model.instances)
+        triangleCount += (model.meshes[instance.mesh].indices.size() + 2) / 3;
+    if (trees.size() != chunks.size() || triangleCount != this->triangleCount())
+        return false;
+    for (auto &material : materials) {
+        if (material.mesh >= model.meshes.size())
+            return false;
+        material.texDiffuse = model.meshes[material.mesh].textureDiffuse;
+    }
+    for (id_t light : lights)
+        scene.lightTriangles.push_back(LightTriangle(light, surface(triangle(light))));
+    return true;
+}
+
+size_t OutOfCoreBVH::triangleCount() const {
+    return chunks.empty() ? 0 : chunks[chunks.size() - 1].firstTriangle + chunks[chunks.size() - 1].triangleCount;
+}
+
+id_t OutOfCoreBVH::chunkOf(id_t triangle) const {
+    return std::upper_bound(chunks.begin(), chunks.end(), triangle,
+                            [](id_t triangle, const Chunk &chunk) { return triangle < chunk.firstTriangle; }) -
+           chunks.begin() - 1;
+}
+
+Triangle OutOfCoreBVH::triangle(id_t id) const {
+    const id_t chunk = chunkOf(id);
+    return tree(chunk).triangles[id - chunks[chunk].firstTriangle];
+}
+
+glm::vec3 OutOfCoreBVH::normal(id_t id) const {
+    const id_t chunk = chunkOf(id);
+    return tree(chunk).normal(id - chunks[chunk].firstTriangle);
+}
+
+const Material &OutOfCoreBVH::material(id_t id) const {
+    const id_t chunk = chunkOf(id);
+    return materials[tree(chunk).shading[id - chunks[chunk].firstTriangle].material];
+}
+
+TriangleTexCoords OutOfCoreBVH::texCoords(id_t id) const {
+    const id_t chunk = chunkOf(id);
+    return tree(chunk).texCoords(id - chunks[chunk].firstTriangle);
+}
+
+/* Front to back traversal of the top level tree, the same as BVH::traverse. For every leaf reached leafTest(chunk) is
+ * called, returning true stops the traversal. tmax is read again after every leaf. */
+template <typename LeafTest>
+bool OutOfCoreBVH::traverse(const Ray &ray, const float &tmax, LeafTest leafTest) {
+    auto enter = [&](const BVHNode &node) {
+        const glm::vec3 t0 = (node.min - ray.origin) * ray.invDir;
+        const glm::vec3 t1 = (node.max - ray.origin) * ray.invDir;
+        const glm::vec3 tsmall = glm::min(t0, t1);
+        const glm::vec3 tbig = glm::max(t0, t1);
+        const float tnear = std::max(std::max(tsmall.x, tsmall.y), std::max(tsmall.z, ray.tnear));
+        const float tfar = std::min(std::min(tbig.x, tbig.y), std::min(tbig.z, tmax));
+        return tnear <= tfar ? tnear : FLT_MAX;
+    };
+
+    id_t stack[stackSize];
+    unsigned stackTop = 0;
+    id_t index = 0;
+    if (nodes.empty() || trees.empty() || enter(nodes[0]) == FLT_MAX)
+        index = id_t(-1);
+
+    while (index != id_t(-1)) {
+        const BVHNode &node = nodes[index];
+        if (node.count) {
+            if (leafTest(node.offset))
+                return true;
+            index = stackTop ? stack[--stackTop] : id_t(-1);
+            continue;
+        }
+
+        id_t near = index + 1;
+        id_t far = node.offset;
+        float tnear = enter(nodes[near]);
+        float tfar = enter(nodes[far]);
+        if (tfar < tnear) {
+            std::swap(near, far);
+            std::swap(tnear, tfar);
+        }
+        if (tnear == FLT_MAX)
+            index = stackTop ? stack[--stackTop] : id_t(-1);
+        else {
+            if (tfar != FLT_MAX)
+                stack[stackTop++] = far;
+            index = near;
+        }
+    }
+    return false;
+}
+
+bool OutOfCoreBVH::intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) {
+    Stats::add(Stats::Rays, 1);
+    bool found = false;
+    distance = ray.tfar;
+    auto closestHit = [&](id_t chunk) {
+        id_t chunkTriangle;
+        if (tree(chunk).closestHit(ray, chunkTriangle, baryPosition, distance)) {
+            found = true;
+            triangle = chunks[chunk].firstTriangle + chunkTriangle;
+        }
+        return false;
+    };
+    traverse(ray, distance, closestHit);
+    return found;
+}
+
+bool OutOfCoreBVH::intersectShadowRay(const Ray &ray, const id_t lightTriangle) {
+    Stats::add(Stats::ShadowRays, 1);
+    auto anyHit = [&](id_t chunk) {
+        const id_t chunkLight = lightTriangle - chunks[chunk].firstTriangle < chunks[chunk].triangleCount
+                                    ? lightTriangle - chunks[chunk].firstTriangle
+                                    : id_t(-1);
+        return tree(chunk).anyHit(ray, chunkLight);
+    };
+    return traverse(ray, ray.tfar, anyHit);
+}
@@ -1,5 +1,8 @@
 #include "rayTracer.hpp"
+#include "model.hpp"
 #include "prng.hpp"
+#include "stats.hpp"
+#include "wavefront.hpp"
 
 #include <FreeImage.h>
 #include <glm/gtc/matrix_transform.hpp>
@@ -8,19 +11,36 @@
 #include <omp.h>
 
 #include <chrono>
+#include <cstdio>
 #include <iostream>
 
+// Only out-of-core structures page chunks, the counts go from the start of the program or of the benchmark.
+static void printPaging() {
+    if (const uint64_t pageIns = Stats::get(Stats::ChunkPageIns))
+        std::cerr << "Chunks were paged in " << pageIns << " times and evicted " << Stats::get(Stats::ChunkEvictions)
+                  << " times\n";
+}
+
+// Share of paths of every length rendered since the counts in before were taken.
+static void printDepths(const uint64_t *before) {
+    uint64_t total = 0;
+    for (unsigned bin = 0; bin < Stats::depthBins; bin++)
+        total += Stats::getPaths(bin) - before[bin];
+    if (total == 0)
+        return;
+    std::cerr << "Path lengths in hits:";
+    for (unsigned bin = 0; bin < Stats::depthBins; bin++) {
+        if (const uint64_t paths = Stats::getPaths(bin) - before[bin])
+            std::cerr << " " << bin << (bin == Stats::depthBins - 1 ? "+" : "") << ": " << 100.f * paths / total << "%";
+    }
+    std::cerr << "\n";
+}
+
 RayTracer::RayTracer(Model &_model, Scene &_scene)
     : scene(_scene), pixels(_scene.yres, std::vector<glm::vec3>(_scene.xres)), data(scene.yres * scene.xres * 3),
-      kdtree(_model, _scene) {}
+      accelerator(Accelerator::create(_model, _scene)) {}
 
 void RayTracer::rayTrace(glm::vec3 eye, glm::vec3 center, glm::vec3 up = {0.f, 1.f, 0.f}, float yview = 1.f) {
-    static unsigned layers = 0;
-    static glm::vec3 lastEye = glm::vec3(FLT_MAX);
-    static glm::vec3 lastCenter = glm::vec3(FLT_MAX);
-    static glm::vec3 lastUp = glm::vec3(FLT_MAX);
-    static float lastYview = -1;
-
     const bool newLayer = (eye == lastEye) && (center == lastCenter) && (lastUp == lastUp) && (yview == lastYview);
     if (newLayer)
         layers++;
@@ -38,133 +58,362 @@ void RayTracer::rayTrace(glm::vec3 eye, glm::vec3 center, glm::vec3 up = {0.f, 1
 
     auto beginTime = std::chrono::high_resolution_clock::now();
 
-    float z = 1.f;
-    float y = z * 0.5f * yview;
-    float x = y * ((float)scene.xres / (float)scene.yres);
-
-    /* rotate the corners of screen to look from VP to LA */
-    auto rotate = glm::inverse(glm::mat3(glm::lookAt(eye, center, up)));
-    const glm::vec3 dy = (1.f / scene.yres) * rotate * glm::vec3(0.f, -2.f * y, 0.f);
-    const glm::vec3 dx = (1.f / scene.xres) * rotate * glm::vec3(2.f * x, 0.f, 0.f);
-    const glm::vec3 leftUpper = rotate * glm::vec3(-x, y, -z);
+    glm::vec3 leftUpper, dx, dy;
+    setupScreen(eye, center, up, yview, leftUpper, dx, dy);
 
     maxVal = 0.f;
     const float invSamples = 1.f / scene.samples;
 
-    PRNG::setSeed();
-#pragma omp parallel for
-    for (unsigned y = 0; y < scene.yres; y++) {
-        for (unsigned x = 0; x < scene.xres; x++) {
-            glm::vec3 temp;
-            for (unsigned s = 0; s < scene.samples; s++)
-                temp += sendRay(
-                    eye, leftUpper + (x + PRNG::uniformFloat(0.f, 1.f)) * dx + (y + PRNG::uniformFloat(0.f, 1.f)) * dy,
-                    1);
+    auto storePixel = [&](unsigned x, unsigned y, const glm::vec3 &color) {
+        pixels[y][x] = (pixels[y][x] * float(layers - 1) + (color * invSamples)) / float(layers);
 
-            pixels[y][x] = (pixels[y][x] * float(layers - 1) + (temp * invSamples)) / float(layers);
+        maxVal = maxVal > pixels[y][x].r ? maxVal : pixels[y][x].r;
+        maxVal = maxVal > pixels[y][x].g ? maxVal : pixels[y][x].g;
+        maxVal = maxVal > pixels[y][x].b ? maxVal : pixels[y][x].b;
+    };
 
-            maxVal = maxVal > pixels[y][x].r ? maxVal : pixels[y][x].r;
-            maxVal = maxVal > pixels[y][x].g ? maxVal : pixels[y][x].g;
-            maxVal = maxVal > pixels[y][x].b ? maxVal : pixels[y][x].b;
+    PRNG::setSeed();
+    const uint64_t allocations = Stats::allocations;
+    uint64_t paths[Stats::depthBins];
+    for (unsigned bin = 0; bin < Stats::depthBins; bin++)
+        paths[bin] = Stats::getPaths(bin);
+    if (scene.wavefront) {
+#pragma omp parallel
+        {
+            // queues of a thread are reused for all its tiles
+            Wavefront engine(*accelerator, scene);
+#pragma omp for schedule(dynamic)
+            for (unsigned ty = 0; ty < scene.yres; ty += Wavefront::tileSide) {
+                for (unsigned tx = 0; tx < scene.xres; tx += Wavefront::tileSide) {
+                    glm::vec3 temp[Wavefront::tileSide * Wavefront::tileSide];
+                    engine.renderTile(eye, leftUpper, dx, dy, tx, ty, temp);
+                    for (unsigned y = ty; y < std::min(ty + Wavefront::tileSide, scene.yres); y++) {
+                        for (unsigned x = tx; x < std::min(tx + Wavefront::tileSide, scene.xres); x++)
+                            storePixel(x, y, temp[(y - ty) * Wavefront::tileSide + (x - tx)]);
+                    }
+                }
+            }
+        }
+    } else if (scene.packets) {
+        // primary rays of a tile go through the accelerator together, then each is shaded on its own
+#pragma omp parallel for schedule(dynamic)
+        for (unsigned ty = 0; ty < scene.yres; ty += packetSide) {
+            for (unsigned tx = 0; tx < scene.xres; tx += packetSide) {
+                glm::vec3 temp[RayPacket::size];
+                RayPacket packet;
+                packet.origin = eye;
+                for (unsigned s = 0; s < scene.samples; s++) {
+                    fillPacket(packet, tx, ty, leftUpper, dx, dy);
+                    accelerator->intersectPacket(packet);
+                    for (unsigned i = 0; i < packet.count; i++) {
+                        glm::vec3 intersection, normal;
+                        BRDF material;
+                        if (!packet.hit[i]) {
+                            temp[i] += scene.background;
+                            Stats::addPath(0);
+                            continue;
+                        }
+                        accelerator->surfaceAt(packet.triangle[i], packet.baryPosition[i], intersection, normal,
+                                               material);
+                        temp[i] += shade(eye, intersection, normal, material);
+                    }
+                }
+                // in the order fillPacket uses
+                unsigned i = 0;
+                for (unsigned y = ty; y < std::min(ty + packetSide, scene.yres); y++) {
+                    for (unsigned x = tx; x < std::min(tx + packetSide, scene.xres); x++)
+                        storePixel(x, y, temp[i++]);
+                }
+            }
+        }
+    } else {
+#pragma omp parallel for
+        for (unsigned y = 0; y < scene.yres; y++) {
+            for (unsigned x = 0; x < scene.xres; x++) {
+                glm::vec3 temp;
+                for (unsigned s = 0; s < scene.samples; s++)
+                    temp += sendRay(eye,
+                                    leftUpper + (x + PRNG::uniformFloat(0.f, 1.f)) * dx +
+                                        (y + PRNG::uniformFloat(0.f, 1.f)) * dy);
+                storePixel(x, y, temp);
+            }
         }
     }
 
     auto finishedTime = std::chrono::high_resolution_clock::now();
-    std::cerr << "took " << (finishedTime - beginTime).count() * 0.000000001f << " seconds.\a\n";
+    // of all threads; the hit path allocates nothing, the wavefront engine only its queues, once per thread
+    const uint64_t renderAllocations = Stats::allocations - allocations;
+    std::cerr << "took " << (finishedTime - beginTime).count() * 0.000000001f << " seconds.\a\n"
+              << renderAllocations << " heap allocations while rendering, "
+              << float(renderAllocations) / (scene.xres * scene.yres * scene.samples) << " per sample\n";
+    printDepths(paths);
+    printPaging();
 }
 
-glm::vec3 RayTracer::sendRay(const glm::vec3 &origin, const glm::vec3 dir, const int k) {
-    glm::vec3 intersection;
-    glm::vec3 normal;
-    BRDF *material;
-    if (intersectRayKDTree(origin, dir, intersection, normal, material)) {
-        // inverse direction
-        const glm::vec3 wo = glm::normalize(origin - intersection);
+// Path with the frame number before the extension, renders/output.exr becomes renders/output_0007.exr.
+static std::string framePath(const std::string &path, unsigned frame) {
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04u", frame);
+    const size_t dot = path.find_last_of('.');
+    const size_t slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + number;
+    return path.substr(0, dot) + number + path.substr(dot);
+}
 
-        // nonzero only when primary ray had hit the light surface
-        glm::vec3 direct = (k > 1) ? glm::vec3(0.f) : material->radiance() * std::max(0.f, glm::dot(wo, normal));
+void RayTracer::renderSequence(Model &model) {
+    // meshes move from where the model placed them
+    const std::vector<MeshInstance> placed = model.instances;
+    float builtCost = accelerator->sahCost();
+    unsigned refits = 0, rebuilds = 0;
+
+    for (unsigned frame = 0; frame < scene.frames; frame++) {
+        const float t = scene.frames > 1 ? float(frame) / float(scene.frames - 1) : 0.f;
+
+        if (frame > 0 && !scene.meshMotions.empty()) {
+            for (id_t i = 0; i < placed.size(); i++) {
+                model.instances[i].transform = placed[i].transform;
+                for (auto &motion : scene.meshMotions) {
+                    if (motion.mesh == placed[i].mesh)
+                        model.instances[i].transform =
+                            glm::translate(glm::mat4(1.f), t * motion.offset) * model.instances[i].transform;
+                }
+            }
 
-        // calculate direct lightning
-        // choose random point on surface lights
-        if (scene.lightTriangles.size()) {
+            auto beginTime = std::chrono::high_resolution_clock::now();
+            const bool refitted = accelerator->refit(model, scene);
+            const float cost = accelerator->sahCost();
+            auto finishedTime = std::chrono::high_resolution_clock::now();
+            if (refitted && cost <= scene.refitThreshold * builtCost) {
+                refits++;
+                std::cout << "Frame " << frame << ": refitted in " << (finishedTime - beginTime).count() * 0.000000001f
+                          << " seconds, SAH cost " << cost << " (" << builtCost << " when built).\n";
+            } else {
+                rebuilds++;
+                if (refitted)
+                    std::cout << "Frame " << frame << ": SAH cost grew from " << builtCost << " to " << cost
+                              << ", building again.\n";
+                // the cache keeps the model as it is in the file, not moved
+                scene.cache = false;
+                scene.lightTriangles.clear();
+                accelerator = Accelerator::create(model, scene);
+                builtCost = accelerator->sahCost();
+            }
+        }
+
+        // every frame starts a new image, even if the camera stays
+        lastYview = -1;
+        rayTrace(glm::mix(scene.VP, scene.VPEnd, t), glm::mix(scene.LA, scene.LAEnd, t), scene.UP, scene.yview);
+        exportImage(framePath(scene.renderPath, frame).c_str());
+    }
+    std::cout << "Rendered " << scene.frames << " frames, the structure was refitted " << refits << " and built "
+              << rebuilds << " times.\n";
+}
 
-            auto &light = scene.randomLight();
-            const Triangle &lightSurface = kdtree.triangles[light.id];
-            const Material &lightMat = kdtree.materials[light.id];
+void RayTracer::benchmark(glm::vec3 eye, glm::vec3 center, glm::vec3 up, float yview) {
+    TriangleBlocks::benchmark(accelerator->triangles);
 
-            // uniform barycentric coordinates
-            const float v0 = PRNG::uniformFloat(0.f, 1.f);
-            const float v1 = PRNG::uniformFloat(0.f, 1.f - v0);
-            const glm::vec3 lightPoint =
-                v0 * lightSurface.posFst + v1 * lightSurface.posSnd + (1.f - v0 - v1) * lightSurface.posTrd;
+    std::cerr << "Benchmarking " << scene.xres << "x" << scene.yres << " primary rays with " << scene.samples
+              << " samples and their shadow rays, using " << omp_get_max_threads() << " threads...\t";
 
-            const float distance = glm::distance(intersection, lightPoint);
-            const glm::vec3 wl = glm::normalize(lightPoint - intersection);
+    glm::vec3 leftUpper, dx, dy;
+    setupScreen(eye, center, up, yview, leftUpper, dx, dy);
 
-            if (!kdtree.intersectShadowRay(intersection + (0.001f * normal), wl, distance, light.id)) {
-                const float geometric =
-                    std::max(0.f, glm::dot(normal, wl) * glm::dot(-wl, lightMat.normal) / (1.f + distance * distance));
+    Stats::reset();
+    PRNG::setSeed();
+    auto beginTime = std::chrono::high_resolution_clock::now();
 
-                direct += lightMat.Ke * (geometric * light.surface * scene.lightTriangles.size()) *
-                          material->f(wl, wo, normal);
+    auto shadowRay = [&](const glm::vec3 &dir, id_t triangle, float distance) {
+        if (!scene.lightTriangles.size())
+            return;
+        const glm::vec3 intersection = eye + distance * dir;
+        const Triangle light = accelerator->triangle(scene.randomLight().id);
+        const glm::vec3 toLight = (light.posFst + light.posSnd + light.posTrd) / 3.f - intersection;
+        accelerator->intersectShadowRay(Ray(intersection + 0.001f * accelerator->normal(triangle),
+                                            glm::normalize(toLight), 0.f, glm::length(toLight)),
+                                        id_t(-1));
+    };
+
+    if (scene.packets) {
+#pragma omp parallel for schedule(dynamic)
+        for (unsigned ty = 0; ty < scene.yres; ty += packetSide) {
+            for (unsigned tx = 0; tx < scene.xres; tx += packetSide) {
+                RayPacket packet;
+                packet.origin = eye;
+                for (unsigned s = 0; s < scene.samples; s++) {
+                    fillPacket(packet, tx, ty, leftUpper, dx, dy);
+                    accelerator->intersectPacket(packet);
+                    for (unsigned i = 0; i < packet.count; i++) {
+                        if (packet.hit[i])
+                            shadowRay(packet.dir[i], packet.triangle[i], packet.distance[i]);
+                    }
+                }
             }
         }
-
-        if (k == scene.k) {
-            delete material;
-            return direct;
+    } else {
+#pragma omp parallel for
+        for (unsigned y = 0; y < scene.yres; y++) {
+            for (unsigned x = 0; x < scene.xres; x++) {
+                for (unsigned s = 0; s < scene.samples; s++) {
+                    const glm::vec3 dir = leftUpper + (x + PRNG::uniformFloat(0.f, 1.f)) * dx +
+                                          (y + PRNG::uniformFloat(0.f, 1.f)) * dy;
+                    id_t triangle;
+                    glm::vec2 baryPos;
+                    float distance;
+                    if (accelerator->intersectRay(Ray(eye, dir), triangle, baryPos, distance))
+                        shadowRay(dir, triangle, distance);
+                }
+            }
         }
+    }
 
-        // calculate indirect light
-        glm::vec3 wi;
-        float pdf;
-        const glm::vec3 f = material->sample_wi(wi, wo, normal, pdf);
-        delete material;
+    auto finishedTime = std::chrono::high_resolution_clock::now();
+    const float seconds = (finishedTime - beginTime).count() * 0.000000001f;
+    const float rays = Stats::get(Stats::Rays) + Stats::get(Stats::ShadowRays);
+    std::cerr << "took " << seconds << " seconds.\n"
+              << Stats::get(Stats::Rays) << " rays and " << Stats::get(Stats::ShadowRays) << " shadow rays, "
+              << rays / seconds * 0.000001f << " Mrays/s\n"
+              << Stats::get(Stats::NodeVisits) / seconds * 0.000001f << " M node visits/s, "
+              << Stats::get(Stats::NodeVisits) / rays << " nodes and " << Stats::get(Stats::TriangleTests) / rays
+              << " triangles per ray\n";
+    const uint64_t skips = Stats::get(Stats::MailboxSkips), repeats = Stats::get(Stats::MailboxRepeats);
+    if (skips + repeats)
+        std::cerr << "Mailboxes saved " << skips / rays << " triangle tests per ray ("
+                  << 100.f * skips / (skips + Stats::get(Stats::TriangleTests)) << "%), " << repeats / rays
+                  << " more were repeated along with triangles new to the ray\n";
+    printPaging();
+}
 
-        // Roussian roulette termination
-        const float Kmax = std::max(std::max(f.r, f.g), f.b);
-        if (pdf == 0.f || PRNG::uniformFloat(0.f, 1.f) > Kmax)
-            return direct;
+void RayTracer::setupScreen(glm::vec3 eye, glm::vec3 center, glm::vec3 up, float yview, glm::vec3 &leftUpper,
+                            glm::vec3 &dx, glm::vec3 &dy) {
+    float z = 1.f;
+    float y = z * 0.5f * yview;
+    float x = y * ((float)scene.xres / (float)scene.yres);
 
-        const float cosine = std::abs(glm::dot(normal, wi));
-        const glm::vec3 indirect = (f * cosine / (pdf * Kmax)) * sendRay(intersection + 0.001f * normal, wi, k + 1);
+    /* rotate the corners of screen to look from VP to LA */
+    auto rotate = glm::inverse(glm::mat3(glm::lookAt(eye, center, up)));
+    dy = (1.f / scene.yres) * rotate * glm::vec3(0.f, -2.f * y, 0.f);
+    dx = (1.f / scene.xres) * rotate * glm::vec3(2.f * x, 0.f, 0.f);
+    leftUpper = rotate * glm::vec3(-x, y, -z);
+}
 
-        return direct + indirect;
+void RayTracer::fillPacket(RayPacket &packet, unsigned tx, unsigned ty, const glm::vec3 &leftUpper, const glm::vec3 &dx,
+                           const glm::vec3 &dy) {
+    packet.count = 0;
+    for (unsigned y = ty; y < std::min(ty + packetSide, scene.yres); y++) {
+        for (unsigned x = tx; x < std::min(tx + packetSide, scene.xres); x++)
+            packet.dir[packet.count++] =
+                leftUpper + (x + PRNG::uniformFloat(0.f, 1.f)) * dx + (y + PRNG::uniformFloat(0.f, 1.f)) * dy;
     }
+}
+
+glm::vec3 RayTracer::sendRay(const glm::vec3 &origin, const glm::vec3 dir) {
+    glm::vec3 intersection;
+    glm::vec3 normal;
+    BRDF material;
+    if (intersectRayModel(origin, dir, intersection, normal, material))
+        return shade(origin, intersection, normal, material);
+    Stats::addPath(0);
     return scene.background;
 }
 
-bool RayTracer::intersectRayKDTree(const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 &intersection,
-                                   glm::vec3 &normal, BRDF *&brdf) {
-    glm::vec2 baryPos;
-    float distance;
-    id_t triangleID;
-    if (!kdtree.intersectRay(origin, direction, triangleID, baryPos, distance))
-        return false;
+glm::vec3 RayTracer::shade(glm::vec3 origin, glm::vec3 intersection, glm::vec3 normal, BRDF material) {
+    glm::vec3 radiance(0.f);
+    glm::vec3 throughput(1.f);
+    int k = 1;
+    for (;; k++) {
+        // inverse direction
+        const glm::vec3 wo = glm::normalize(origin - intersection);
+        radiance += throughput * directLight(wo, intersection, normal, material, k);
+
+        glm::vec3 wi;
+        if (!bounce(scene, material, wo, normal, k, throughput, wi))
+            break;
+        origin = intersection + 0.001f * normal;
+        if (!intersectRayModel(origin, wi, intersection, normal, material)) {
+            radiance += throughput * scene.background;
+            break;
+        }
+    }
+    Stats::addPath(k);
+    return radiance;
+}
 
-    const Triangle &triangle = kdtree.triangles[triangleID];
-    const Material &material = kdtree.materials[triangleID];
+glm::vec3 RayTracer::directLight(const glm::vec3 &wo, const glm::vec3 &intersection, const glm::vec3 &normal,
+                                 const BRDF &material, int k) {
+    // nonzero only when primary ray had hit the light surface
+    glm::vec3 direct = (k > 1) ? glm::vec3(0.f) : material.radiance() * std::max(0.f, glm::dot(wo, normal));
+
+    Ray shadowRay;
+    id_t light;
+    glm::vec3 contribution;
+    if (sampleLight(*accelerator, scene, wo, intersection, normal, material, shadowRay, light, contribution) &&
+        !accelerator->intersectShadowRay(shadowRay, light))
+        direct += contribution;
+    return direct;
+}
 
-    normal = material.normal;
+bool RayTracer::sampleLight(const Accelerator &accelerator, Scene &scene, const glm::vec3 &wo,
+                            const glm::vec3 &intersection, const glm::vec3 &normal, const BRDF &material,
+                            Ray &shadowRay, id_t &lightID, glm::vec3 &contribution) {
+    if (!scene.lightTriangles.size())
+        return false;
 
-    const float baryPosz = (1.f - baryPos.x - baryPos.y);
-    intersection = triangle.posFst * baryPosz + triangle.posSnd * baryPos.x + triangle.posTrd * baryPos.y;
+    // choose random point on surface lights
+    auto &light = scene.randomLight();
+    const Triangle lightSurface = accelerator.triangle(light.id);
+
+    // uniform barycentric coordinates
+    const float v0 = PRNG::uniformFloat(0.f, 1.f);
+    const float v1 = PRNG::uniformFloat(0.f, 1.f - v0);
+    const glm::vec3 lightPoint =
+        v0 * lightSurface.posFst + v1 * lightSurface.posSnd + (1.f - v0 - v1) * lightSurface.posTrd;
+
+    const float distance = glm::distance(intersection, lightPoint);
+    const glm::vec3 wl = glm::normalize(lightPoint - intersection);
+    shadowRay = Ray(intersection + (0.001f * normal), wl, 0.f, distance);
+    lightID = light.id;
+
+    const float geometric = std::max(0.f, glm::dot(normal, wl) * glm::dot(-wl, accelerator.normal(light.id)) /
+                                              (1.f + distance * distance));
+    contribution = accelerator.material(light.id).Ke *
+                   (geometric * light.surface * scene.lightTriangles.size()) * material.f(wl, wo, normal);
+    return true;
+}
 
-    const glm::vec3 Kd =
-        material.texDiffuse && material.texDiffuse->image
-            ? material.texDiffuse->getColorAt(material.texFst * baryPosz + material.texSnd * baryPos.x +
-                                              material.texTrd * baryPos.y)
-            : material.Kd;
+bool RayTracer::bounce(const Scene &scene, const BRDF &material, const glm::vec3 &wo, const glm::vec3 &normal, int k,
+                       glm::vec3 &throughput, glm::vec3 &wi) {
+    if (k >= scene.k)
+        return false;
 
-    switch (material.BRDFtype) {
-    case BRDFT::Diffuse:
-        brdf = new Diffuse(Kd);
-        break;
-    case BRDFT::Emissive:
-        brdf = new Emissive(Kd, material.Ke);
-        break;
+    // calculate indirect light
+    float pdf;
+    const glm::vec3 f = material.sample_wi(wi, wo, normal, pdf);
+    if (pdf == 0.f)
+        return false;
+    // the albedo, for Lambertian materials
+    const glm::vec3 weight = f * (std::abs(glm::dot(normal, wi)) / pdf);
+
+    // Russian roulette, paths which would carry little light on are ended and the surviving ones weigh more
+    if (k >= scene.rouletteDepth) {
+        const glm::vec3 carried = throughput * weight;
+        const float survival = std::min(1.f, std::max(std::max(carried.r, carried.g), carried.b));
+        if (PRNG::uniformFloat(0.f, 1.f) >= survival)
+            return false;
+        throughput /= survival;
     }
+    throughput *= weight;
+    return true;
+}
 
+bool RayTracer::intersectRayModel(const glm::vec3 &origin, const glm::vec3 &direction, glm::vec3 &intersection,
+                                  glm::vec3 &normal, BRDF &brdf) {
+    glm::vec2 baryPos;
+    float distance;
+    id_t triangleID;
+    if (!accelerator->intersectRay(Ray(origin, direction), triangleID, baryPos, distance))
+        return false;
+    accelerator->surfaceAt(triangleID, baryPos, intersection, normal, brdf);
     return true;
 }
 
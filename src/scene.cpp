@@ -14,17 +14,32 @@ Scene::Scene(int argc, char **argv) : Scene(argc > 1 ? argv[1] : "cornell.rtc")
     for (int i = 2; i < argc; i++)
         params.emplace_back(argv[i]);
 
+    bool VPEndSet = false, LAEndSet = false;
     for (unsigned i = 0; i < params.size(); i++) {
         if (params[i][0] == '#')
             continue;
         else if (params[i] == "no-preview")
             this->usingOpenGLPreview = false;
+        else if (params[i] == "benchmark")
+            this->benchmark = true;
+        else if (params[i] == "packets")
+            this->packets = true;
+        else if (params[i] == "wavefront")
+            this->wavefront = true;
+        else if (params[i] == "no-cache")
+            this->cache = false;
+        else if (params[i] == "mailbox")
+            this->mailbox = true;
+        else if (params[i] == "compressed-nodes")
+            this->compressedNodes = true;
         else if (params[i] == "input")
             this->objPath = params[++i];
         else if (params[i] == "output")
             this->renderPath = params[++i];
         else if (params[i] == "k")
             this->k = std::stoi(params[++i]);
+        else if (params[i] == "roulette-depth")
+            this->rouletteDepth = std::stoi(params[++i]);
         else if (params[i] == "xres")
             this->xres = std::stoi(params[++i]);
         else if (params[i] == "yres")
@@ -44,7 +59,29 @@ Scene::Scene(int argc, char **argv) : Scene(argc > 1 ? argv[1] : "cornell.rtc")
             const float y = std::stof(params[++i]);
             const float z = std::stof(params[++i]);
             this->UP = glm::vec3(x, y, z);
-        } else if (params[i] == "yview")
+        } else if (params[i] == "VP-end") {
+            const float x = std::stof(params[++i]);
+            const float y = std::stof(params[++i]);
+            const float z = std::stof(params[++i]);
+            this->VPEnd = glm::vec3(x, y, z);
+            VPEndSet = true;
+        } else if (params[i] == "LA-end") {
+            const float x = std::stof(params[++i]);
+            const float y = std::stof(params[++i]);
+            const float z = std::stof(params[++i]);
+            this->LAEnd = glm::vec3(x, y, z);
+            LAEndSet = true;
+        } else if (params[i] == "move-mesh") {
+            const unsigned mesh = std::stoi(params[++i]);
+            const float x = std::stof(params[++i]);
+            const float y = std::stof(params[++i]);
+            const float z = std::stof(params[++i]);
+            meshMotions.push_back({mesh, glm::vec3(x, y, z)});
+        } else if (params[i] == "frames")
+            frames = std::stoi(params[++i]);
+        else if (params[i] == "refit-threshold")
+            refitThreshold = std::stof(params[++i]);
+        else if (params[i] == "yview")
             yview = std::stof(params[++i]);
         else if (params[i] == "preview-height")
             previewHeight = std::stoi(params[++i]);
@@ -52,17 +89,75 @@ Scene::Scene(int argc, char **argv) : Scene(argc > 1 ? argv[1] : "cornell.rtc")
             samples = std::stoi(params[++i]);
         else if (params[i] == "exposure")
             exposure = std::stof(params[++i]);
+        else if (params[i] == "accel") {
+            i++;
+            if (params[i] == "kdtree")
+                accelerator = AcceleratorT::KDTree;
+            else if (params[i] == "bvh")
+                accelerator = AcceleratorT::BVH;
+            else if (params[i] == "bvh4")
+                accelerator = AcceleratorT::BVH4;
+            else if (params[i] == "bvh8")
+                accelerator = AcceleratorT::BVH8;
+            else if (params[i] == "two-level")
+                accelerator = AcceleratorT::TwoLevel;
+            else if (params[i] == "out-of-core")
+                accelerator = AcceleratorT::OutOfCore;
+            else
+                std::cerr << "Invalid acceleration structure \"" << params[i]
+                          << "\", expected kdtree, bvh, bvh4, bvh8, two-level or out-of-core\n";
+        } else if (params[i] == "bvh-builder") {
+            i++;
+            if (params[i] == "sah")
+                bvhBuilder = BVHBuilder::SAH;
+            else if (params[i] == "lbvh")
+                bvhBuilder = BVHBuilder::LBVH;
+            else
+                std::cerr << "Invalid BVH builder \"" << params[i] << "\", expected sah or lbvh\n";
+        } else if (params[i] == "lbvh-treelets")
+            lbvhTreelets = true;
+        else if (params[i] == "chunk-triangles")
+            chunkTriangles = std::stoi(params[++i]);
+        else if (params[i] == "chunk-budget")
+            chunkBudget = std::stoull(params[++i]) << 20;
         else if (params[i] == "kdtree-leaf-size")
             kdtreeLeafSize = std::stoi(params[++i]);
-        else
+        else if (params[i] == "kdtree-stats")
+            kdtreeStats = params[++i];
+        else if (params[i] == "kdtree-traversal-cost")
+            kdtreeTraversalCost = std::stof(params[++i]);
+        else if (params[i] == "kdtree-intersection-cost")
+            kdtreeIntersectionCost = std::stof(params[++i]);
+        else if (params[i] == "kdtree-empty-bonus")
+            kdtreeEmptyBonus = std::stof(params[++i]);
+        else if (params[i] == "triangle-format") {
+            i++;
+            if (params[i] == "edges")
+                triangleFormat = TriangleFormat::Edges;
+            else if (params[i] == "normal")
+                triangleFormat = TriangleFormat::EdgesNormal;
+            else if (params[i] == "planes")
+                triangleFormat = TriangleFormat::Planes;
+            else
+                std::cerr << "Invalid triangle format \"" << params[i] << "\", expected edges, normal or planes\n";
+        } else
             std::cerr << "Invalid argument \"" << params[i] << "\"\n";
     }
+    // a camera without end points stays where it is
+    if (!VPEndSet)
+        VPEnd = VP;
+    if (!LAEndSet)
+        LAEnd = LA;
 }
 
 // set default values and parse input from file
 Scene::Scene(std::string filename)
-    : renderPath("renders/output.exr"), k(3), xres(400), yres(300), VP(0, 0, 2), LA(0, 0, 0), UP(0, 1, 0), yview(1),
-      usingOpenGLPreview(true), previewHeight(900), kdtreeLeafSize(8), background(0), samples(100), exposure(5) {
+    : renderPath("renders/output.exr"), k(3), rouletteDepth(2), xres(400), yres(300), VP(0, 0, 2), LA(0, 0, 0),
+      UP(0, 1, 0), yview(1), usingOpenGLPreview(true), benchmark(false), packets(false), wavefront(false), cache(true),
+      previewHeight(900), accelerator(AcceleratorT::KDTree), bvhBuilder(BVHBuilder::SAH), lbvhTreelets(false),
+      chunkTriangles(1 << 16), chunkBudget(size_t(1) << 30), kdtreeLeafSize(8), kdtreeTraversalCost(15.f),
+      kdtreeIntersectionCost(20.f), kdtreeEmptyBonus(0.f), mailbox(false), compressedNodes(false),
+      triangleFormat(TriangleFormat::Edges), background(0), samples(100), frames(0), refitThreshold(1.3f), exposure(5) {
     std::ifstream file(filename);
     std::string input;
     while (std::getline(file, input)) {
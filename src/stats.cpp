@@ -0,0 +1,44 @@
+#include "stats.hpp"
+
+#include <cstdlib>
+#include <new>
+
+namespace Stats {
+ThreadCounters counters[maxThreads];
+std::atomic<uint64_t> allocations(0);
+
+uint64_t get(Counter counter) {
+    uint64_t sum = 0;
+    for (auto &thread : counters)
+        sum += thread.values[counter];
+    return sum;
+}
+
+uint64_t getPaths(unsigned bin) {
+    uint64_t sum = 0;
+    for (auto &thread : counters)
+        sum += thread.depths[bin];
+    return sum;
+}
+
+void reset() {
+    for (auto &thread : counters) {
+        for (auto &value : thread.values)
+            value = 0;
+        for (auto &paths : thread.depths)
+            paths = 0;
+    }
+}
+} // namespace Stats
+
+// Array and nothrow forms end up here too.
+void *operator new(std::size_t size) {
+    Stats::allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept { std::free(memory); }
+
+void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
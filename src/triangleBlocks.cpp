@@ -0,0 +1,420 @@
+#include "triangleBlocks.hpp"
+#include "accelerator.hpp"
+#include "cacheFile.hpp"
+#include "prng.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+
+typedef vfloat<TriangleBlocks::size> vfloatT;
+
+unsigned TriangleBlocks::floatsPerTriangle(TriangleFormat format) {
+    switch (format) {
+    case TriangleFormat::Edges:
+        return 9;
+    case TriangleFormat::EdgesNormal:
+    case TriangleFormat::Planes:
+        return 12;
+    }
+    return 0;
+}
+
+TriangleBlocks::TriangleBlocks(TriangleFormat format) : format(format), rows(floatsPerTriangle(format)) {}
+
+void TriangleBlocks::reserve(size_t blockCount) {
+    data.reserve(blockCount * rows * size);
+    lanes.reserve(blockCount * size);
+}
+
+size_t TriangleBlocks::memoryUsage() const {
+    return data.size() * sizeof(float) + (lanes.size() + laneBases.size()) * sizeof(id_t) +
+           laneDeltas.size() * sizeof(uint16_t);
+}
+
+void TriangleBlocks::serialize(CacheFile &cache) {
+    cache.array(data);
+    cache.array(lanes);
+    cache.array(laneBases);
+    cache.array(laneDeltas);
+}
+
+id_t TriangleBlocks::pack(const Geometry &triangles, const id_t *ids, id_t count) {
+    const id_t first = data.size() / (rows * size);
+    for (id_t begin = 0; begin < count; begin += size) {
+        data.resize(data.size() + rows * size, 0.f);
+        float *block = data.end() - rows * size;
+        for (unsigned lane = 0; lane < size; lane++) {
+            if (begin + lane >= count) {
+                lanes.push_back(id_t(-1));
+                continue;
+            }
+            lanes.push_back(ids[begin + lane]);
+            packLane(block, lane, triangles[ids[begin + lane]]);
+        }
+    }
+    return first;
+}
+
+void TriangleBlocks::repack(const Geometry &triangles) {
+    for (size_t i = 0; i < data.size() / rows; i++) {
+        const id_t triangle = laneTriangle(i);
+        if (triangle != id_t(-1))
+            packLane(&data[i / size * rows * size], i % size, triangles[triangle]);
+    }
+}
+
+bool TriangleBlocks::compactLanes() {
+    const size_t blockCount = lanes.size() / size;
+    for (size_t b = 0; b < blockCount; b++) {
+        id_t min = id_t(-1), max = 0;
+        for (unsigned lane = 0; lane < size; lane++) {
+            const id_t triangle = lanes[b * size + lane];
+            if (triangle != id_t(-1)) {
+                min = std::min(min, triangle);
+                max = std::max(max, triangle);
+            }
+        }
+        if (min != id_t(-1) && max - min >= UINT16_MAX)
+            return false;
+    }
+
+    laneBases.resize(blockCount, 0);
+    laneDeltas.resize(lanes.size(), 0);
+    for (size_t b = 0; b < blockCount; b++) {
+        laneBases[b] = *std::min_element(&lanes[b * size], &lanes[b * size] + size);
+        for (unsigned lane = 0; lane < size; lane++) {
+            const id_t triangle = lanes[b * size + lane];
+            laneDeltas[b * size + lane] = triangle == id_t(-1) ? UINT16_MAX : triangle - laneBases[b];
+        }
+    }
+    lanes.clear();
+    return true;
+}
+
+const id_t *TriangleBlocks::blockTriangles(id_t block, id_t *ids) const {
+    if (laneDeltas.empty())
+        return &lanes[block * size];
+    for (unsigned lane = 0; lane < size; lane++)
+        ids[lane] = laneTriangle(block * size + lane);
+    return ids;
+}
+
+void TriangleBlocks::bounds(const Geometry &triangles, id_t first, id_t count, glm::vec3 &min,
+                            glm::vec3 &max) const {
+    // a leaf fills its lanes in order, only the last block has unused ones
+    for (id_t i = first * size; i < first * size + count; i++) {
+        const Triangle tri = triangles[laneTriangle(i)];
+        min = glm::min(min, glm::min(glm::min(tri.posFst, tri.posSnd), tri.posTrd));
+        max = glm::max(max, glm::max(glm::max(tri.posFst, tri.posSnd), tri.posTrd));
+    }
+}
+
+void TriangleBlocks::packLane(float *block, unsigned lane, const Triangle &tri) {
+    const glm::vec3 e1 = tri.posSnd - tri.posFst;
+    const glm::vec3 e2 = tri.posTrd - tri.posFst;
+    const glm::vec3 normal = glm::cross(e1, e2);
+    float values[12];
+    switch (format) {
+    case TriangleFormat::Edges:
+    case TriangleFormat::EdgesNormal:
+        for (id_t axis = 0; axis < 3; axis++) {
+            values[axis] = tri.posFst[axis];
+            values[3 + axis] = e1[axis];
+            values[6 + axis] = e2[axis];
+            values[9 + axis] = normal[axis];
+        }
+        break;
+    case TriangleFormat::Planes: {
+        // dot(n1, p) + d1 and dot(n2, p) + d2 are the barycentric coordinates of p lying in the plane
+        const float area = glm::dot(normal, normal);
+        const glm::vec3 n1 = area > 0.f ? glm::cross(e2, normal) / area : glm::vec3(0.f);
+        const glm::vec3 n2 = area > 0.f ? glm::cross(normal, e1) / area : glm::vec3(0.f);
+        for (id_t axis = 0; axis < 3; axis++) {
+            values[axis] = normal[axis];
+            values[4 + axis] = n1[axis];
+            values[8 + axis] = n2[axis];
+        }
+        values[3] = glm::dot(normal, tri.posFst);
+        values[7] = -glm::dot(n1, tri.posFst);
+        values[11] = -glm::dot(n2, tri.posFst);
+        break;
+    }
+    }
+    for (unsigned row = 0; row < rows; row++)
+        block[row * size + lane] = values[row];
+}
+
+/* Intersects the ray with every lane of a block at once. Bit i of the result is set when the ray hits the i-th
+ * triangle at least tmin and less than tmax from its origin, u, v and t are only meaningful for such lanes. All formats
+ * reject the same nearly parallel triangles as the scalar Möller–Trumbore did. */
+template <TriangleFormat F>
+static unsigned intersectBlock(const float *block, const vfloatT org[3], const vfloatT dir[3], const vfloatT &tmin,
+                               const vfloatT &tmax, vfloatT &u, vfloatT &v, vfloatT &t) {
+    auto row = [block](unsigned r) { return vfloatT::load(block + r * TriangleBlocks::size); };
+    const vfloatT epsilon = vfloatT::broadcast(std::numeric_limits<float>::epsilon());
+    const vfloatT zero = vfloatT::broadcast(0.f);
+    const vfloatT one = vfloatT::broadcast(1.f);
+
+    if (F == TriangleFormat::Planes) {
+        const vfloatT normal[3] = {row(0), row(1), row(2)};
+        const vfloatT det = dir[0] * normal[0] + dir[1] * normal[1] + dir[2] * normal[2];
+        unsigned mask = lessEqual(epsilon, det) | lessEqual(det, zero - epsilon);
+        if (!mask)
+            return 0;
+        const vfloatT f = one / det;
+        const vfloatT tt = row(3) - (org[0] * normal[0] + org[1] * normal[1] + org[2] * normal[2]);
+        t = tt * f;
+        mask &= lessEqual(tmin, t) & less(t, tmax);
+        if (!mask)
+            return 0;
+
+        // hit point scaled by det
+        const vfloatT p[3] = {det * org[0] + tt * dir[0], det * org[1] + tt * dir[1], det * org[2] + tt * dir[2]};
+        u = f * (p[0] * row(4) + p[1] * row(5) + p[2] * row(6) + det * row(7));
+        mask &= lessEqual(zero, u) & lessEqual(u, one);
+        if (!mask)
+            return 0;
+        v = f * (p[0] * row(8) + p[1] * row(9) + p[2] * row(10) + det * row(11));
+        return mask & lessEqual(zero, v) & lessEqual(u + v, one);
+    }
+
+    const vfloatT e1[3] = {row(3), row(4), row(5)};
+    const vfloatT e2[3] = {row(6), row(7), row(8)};
+    const vfloatT s[3] = {org[0] - row(0), org[1] - row(1), org[2] - row(2)};
+
+    if (F == TriangleFormat::EdgesNormal) {
+        const vfloatT normal[3] = {row(9), row(10), row(11)};
+        const vfloatT a = zero - (dir[0] * normal[0] + dir[1] * normal[1] + dir[2] * normal[2]);
+        unsigned mask = lessEqual(epsilon, a) | lessEqual(a, zero - epsilon);
+        if (!mask)
+            return 0;
+        const vfloatT f = one / a;
+
+        const vfloatT r[3] = {s[1] * dir[2] - s[2] * dir[1], s[2] * dir[0] - s[0] * dir[2],
+                              s[0] * dir[1] - s[1] * dir[0]};
+        u = f * (e2[0] * r[0] + e2[1] * r[1] + e2[2] * r[2]);
+        mask &= lessEqual(zero, u) & lessEqual(u, one);
+        if (!mask)
+            return 0;
+        v = f * (e1[0] * r[0] + e1[1] * r[1] + e1[2] * r[2]);
+        v = zero - v;
+        mask &= lessEqual(zero, v) & lessEqual(u + v, one);
+        if (!mask)
+            return 0;
+        t = f * (s[0] * normal[0] + s[1] * normal[1] + s[2] * normal[2]);
+        return mask & lessEqual(tmin, t) & less(t, tmax);
+    }
+
+    // based off original Möller–Trumbore algorithm
+    const vfloatT p[3] = {dir[1] * e2[2] - dir[2] * e2[1], dir[2] * e2[0] - dir[0] * e2[2],
+                          dir[0] * e2[1] - dir[1] * e2[0]};
+    const vfloatT a = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    unsigned mask = lessEqual(epsilon, a) | lessEqual(a, zero - epsilon);
+    if (!mask)
+        return 0;
+    const vfloatT f = one / a;
+
+    u = f * (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]);
+    mask &= lessEqual(zero, u) & lessEqual(u, one);
+    if (!mask)
+        return 0;
+
+    const vfloatT q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+    v = f * (dir[0] * q[0] + dir[1] * q[1] + dir[2] * q[2]);
+    mask &= lessEqual(zero, v) & lessEqual(u + v, one);
+    if (!mask)
+        return 0;
+
+    t = f * (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]);
+    return mask & lessEqual(tmin, t) & less(t, tmax);
+}
+
+template <TriangleFormat F>
+bool TriangleBlocks::closestHit(const Ray &ray, id_t first, id_t count, id_t &triangle, glm::vec2 &baryPosition,
+                                float &distance, Mailbox *mailbox) const {
+    const vfloatT org[3] = {vfloatT::broadcast(ray.origin.x), vfloatT::broadcast(ray.origin.y),
+                            vfloatT::broadcast(ray.origin.z)};
+    const vfloatT dirs[3] = {vfloatT::broadcast(ray.dir.x), vfloatT::broadcast(ray.dir.y),
+                             vfloatT::broadcast(ray.dir.z)};
+    const vfloatT tmin = vfloatT::broadcast(ray.tnear);
+    bool found = false;
+    id_t skipped = 0, repeated = 0;
+    for (id_t b = first, left = count; left; b++) {
+        const id_t used = std::min<id_t>(left, size);
+        left -= used;
+        if (mailbox) {
+            id_t ids[size];
+            const unsigned seen = mailbox->seen(blockTriangles(b, ids), used);
+            if (seen == used) {
+                skipped += used;
+                continue;
+            }
+            repeated += seen;
+        }
+        vfloatT u, v, t;
+        unsigned hits =
+            intersectBlock<F>(&data[b * rows * size], org, dirs, tmin, vfloatT::broadcast(distance), u, v, t);
+        if (!hits)
+            continue;
+
+        // nearest of the hits in this block
+        float us[size], vs[size], ts[size];
+        u.store(us);
+        v.store(vs);
+        t.store(ts);
+        while (hits) {
+            const unsigned lane = __builtin_ctz(hits);
+            hits &= hits - 1;
+            if (ts[lane] < distance) {
+                distance = ts[lane];
+                baryPosition = glm::vec2(us[lane], vs[lane]);
+                triangle = laneTriangle(b * size + lane);
+                found = true;
+            }
+        }
+    }
+    Stats::add(Stats::TriangleTests, count - skipped);
+    if (mailbox) {
+        Stats::add(Stats::MailboxSkips, skipped);
+        Stats::add(Stats::MailboxRepeats, repeated);
+    }
+    return found;
+}
+
+template <TriangleFormat F>
+bool TriangleBlocks::anyHit(const Ray &ray, id_t first, id_t count, id_t lightTriangle, Mailbox *mailbox) const {
+    const vfloatT org[3] = {vfloatT::broadcast(ray.origin.x), vfloatT::broadcast(ray.origin.y),
+                            vfloatT::broadcast(ray.origin.z)};
+    const vfloatT dirs[3] = {vfloatT::broadcast(ray.dir.x), vfloatT::broadcast(ray.dir.y),
+                             vfloatT::broadcast(ray.dir.z)};
+    const vfloatT tmin = vfloatT::broadcast(ray.tnear);
+    const vfloatT tmax = vfloatT::broadcast(ray.tfar);
+    bool occluded = false;
+    id_t tested = 0, skipped = 0, repeated = 0;
+    for (id_t b = first; !occluded && tested + skipped < count; b++) {
+        const id_t used = std::min<id_t>(count - tested - skipped, size);
+        // a triangle tested before was not hit, or the ray would have stopped there
+        if (mailbox) {
+            id_t ids[size];
+            const unsigned seen = mailbox->seen(blockTriangles(b, ids), used);
+            if (seen == used) {
+                skipped += used;
+                continue;
+            }
+            repeated += seen;
+        }
+        tested += used;
+        vfloatT u, v, t;
+        for (unsigned hits = intersectBlock<F>(&data[b * rows * size], org, dirs, tmin, tmax, u, v, t); hits;
+             hits &= hits - 1)
+            occluded |= laneTriangle(b * size + __builtin_ctz(hits)) != lightTriangle;
+    }
+    Stats::add(Stats::TriangleTests, tested);
+    if (mailbox) {
+        Stats::add(Stats::MailboxSkips, skipped);
+        Stats::add(Stats::MailboxRepeats, repeated);
+    }
+    return occluded;
+}
+
+bool TriangleBlocks::intersectRay(const Ray &ray, id_t first, id_t count, id_t &triangle, glm::vec2 &baryPosition,
+                                  float &distance, Mailbox *mailbox) const {
+    switch (format) {
+    case TriangleFormat::Edges:
+        return closestHit<TriangleFormat::Edges>(ray, first, count, triangle, baryPosition, distance, mailbox);
+    case TriangleFormat::EdgesNormal:
+        return closestHit<TriangleFormat::EdgesNormal>(ray, first, count, triangle, baryPosition, distance, mailbox);
+    case TriangleFormat::Planes:
+        return closestHit<TriangleFormat::Planes>(ray, first, count, triangle, baryPosition, distance, mailbox);
+    }
+    return false;
+}
+
+bool TriangleBlocks::intersectShadowRay(const Ray &ray, id_t first, id_t count, id_t lightTriangle,
+                                        Mailbox *mailbox) const {
+    switch (format) {
+    case TriangleFormat::Edges:
+        return anyHit<TriangleFormat::Edges>(ray, first, count, lightTriangle, mailbox);
+    case TriangleFormat::EdgesNormal:
+        return anyHit<TriangleFormat::EdgesNormal>(ray, first, count, lightTriangle, mailbox);
+    case TriangleFormat::Planes:
+        return anyHit<TriangleFormat::Planes>(ray, first, count, lightTriangle, mailbox);
+    }
+    return false;
+}
+
+// one per thread, like Stats counters
+static Mailbox mailboxes[Stats::maxThreads];
+
+Mailbox &Mailbox::forRay() {
+    Mailbox &mailbox = mailboxes[omp_get_thread_num() % Stats::maxThreads];
+    // once the tag wraps around, slots of rays long gone could look current
+    if (++mailbox.ray == 0) {
+        for (Slot &slot : mailbox.slots)
+            slot = {0, 0};
+        mailbox.ray = 1;
+    }
+    return mailbox;
+}
+
+unsigned Mailbox::seen(const id_t *ids, unsigned count) {
+    unsigned seen = 0;
+    for (unsigned i = 0; i < count; i++) {
+        Slot &slot = slots[ids[i] % size];
+        seen += slot.ray == ray && slot.triangle == ids[i];
+        slot = {ray, ids[i]};
+    }
+    return seen;
+}
+
+/* Every format gets the same blocks of consecutive triangles, which mostly lie close to each other, and the same rays
+ * aimed from one random triangle at another, each tested against a run of blocks around its target. */
+void TriangleBlocks::benchmark(const Geometry &triangles) {
+    const size_t triangleCount = std::min<size_t>(triangles.size(), 1 << 16);
+    const unsigned rayCount = 1 << 14, blocksPerRay = 16;
+    if (triangleCount == 0)
+        return;
+    std::vector<id_t> ids(triangleCount);
+    for (id_t i = 0; i < triangleCount; i++)
+        ids[i] = i;
+    auto centroid = [&](id_t i) { return (triangles[i].posFst + triangles[i].posSnd + triangles[i].posTrd) / 3.f; };
+
+    PRNG::setSeed();
+    std::vector<Ray> rays;
+    rays.reserve(rayCount);
+    std::vector<id_t> targets(rayCount);
+    for (unsigned i = 0; i < rayCount; i++) {
+        targets[i] = std::min<id_t>(triangleCount - 1, PRNG::uniformFloat(0.f, triangleCount));
+        const glm::vec3 origin =
+            centroid(std::min<id_t>(triangles.size() - 1, PRNG::uniformFloat(0.f, triangles.size())));
+        rays.emplace_back(origin, glm::normalize(centroid(targets[i]) - origin + glm::vec3(1e-6f)));
+    }
+
+    const char *names[] = {"edges", "normal", "planes"};
+    for (TriangleFormat format : {TriangleFormat::Edges, TriangleFormat::EdgesNormal, TriangleFormat::Planes}) {
+        TriangleBlocks blocks(format);
+        blocks.pack(triangles, ids.data(), triangleCount);
+        const id_t blockCount = blocksFor(triangleCount);
+
+        size_t hits = 0, tests = 0;
+        auto beginTime = std::chrono::high_resolution_clock::now();
+        for (unsigned i = 0; i < rayCount; i++) {
+            const id_t first = std::min<id_t>(targets[i] / size, blockCount - std::min<id_t>(blockCount, blocksPerRay));
+            const id_t count = std::min<id_t>(triangleCount - first * size, blocksPerRay * size);
+            id_t triangle;
+            glm::vec2 baryPosition;
+            float distance = FLT_MAX;
+            tests += count;
+            hits += blocks.intersectRay(rays[i], first, count, triangle, baryPosition, distance);
+        }
+        auto finishedTime = std::chrono::high_resolution_clock::now();
+        const float seconds = (finishedTime - beginTime).count() * 0.000000001f;
+
+        std::cerr << "Triangle format " << names[int(format)] << ": " << tests / seconds * 0.000001f
+                  << " M triangle tests/s, " << (floatsPerTriangle(format) + 1) * 4 << " bytes per triangle, " << hits
+                  << " rays hit\n";
+    }
+}
@@ -0,0 +1,325 @@
+#include "twoLevelBvh.hpp"
+#include "cacheFile.hpp"
+#include "model.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+TwoLevelBVH::TwoLevelBVH(Model &model, Scene &scene) : Accelerator(scene), scene(scene) {
+    minCoords = glm::vec3(FLT_MAX);
+    maxCoords = glm::vec3(-FLT_MAX);
+
+    size_t meshTriangles = 0;
+    for (auto &mesh : model.meshes) {
+        meshTrees.emplace_back(new MeshTree(mesh, scene));
+        meshTriangles += meshTrees.back()->triangles.size();
+    }
+
+    std::vector<BuildInstance> bounds(model.instances.size());
+    id_t firstTriangle = 0;
+    instances.reserve(model.instances.size());
+    for (id_t i = 0; i < model.instances.size(); i++) {
+        const MeshInstance &placed = model.instances[i];
+        instances.push_back({placed.transform, glm::inverse(placed.transform), placed.mesh, firstTriangle});
+        firstTriangle += meshTrees[placed.mesh]->triangles.size();
+        bounds[i] = worldBounds(instances[i]);
+        minCoords = glm::min(minCoords, bounds[i].min);
+        maxCoords = glm::max(maxCoords, bounds[i].max);
+    }
+
+    std::vector<id_t> order(instances.size());
+    for (id_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    leafInstances = std::move(order);
+    nodes.reserve(2 * instances.size());
+    if (instances.size())
+        build(bounds, 0, instances.size(), stackSize - 1);
+
+    findLights(model, scene);
+    std::cout << "Two-level BVH over " << instances.size() << " instances of " << meshTrees.size()
+              << " meshes keeps " << meshTriangles << " of " << firstTriangle << " triangles.\n";
+}
+
+TwoLevelBVH::TwoLevelBVH(Scene &scene) : Accelerator(scene), scene(scene) {}
+
+size_t TwoLevelBVH::memoryUsage() {
+    size_t memory = nodes.size() * sizeof(BVHNode) + instances.size() * sizeof(Instance) +
+                    leafInstances.size() * sizeof(id_t);
+    for (auto &tree : meshTrees)
+        memory += tree->memoryUsage();
+    return memory;
+}
+
+void TwoLevelBVH::serialize(CacheFile &cache) {
+    Accelerator::serialize(cache);
+    uint64_t meshCount = meshTrees.size();
+    cache.value(meshCount);
+    if (cache.loaded() && cache.good()) {
+        meshTrees.clear();
+        for (uint64_t i = 0; i < meshCount && cache.good(); i++)
+            meshTrees.emplace_back(new MeshTree(scene));
+    }
+    for (auto &tree : meshTrees)
+        tree->serialize(cache);
+    cache.array(instances);
+    cache.array(nodes);
+    cache.array(leafInstances);
+}
+
+bool TwoLevelBVH::linkModel(Model &model, Scene &scene) {
+    if (meshTrees.size() != model.meshes.size() || instances.size() != model.instances.size())
+        return false;
+    for (id_t i = 0; i < meshTrees.size(); i++) {
+        const Mesh &mesh = model.meshes[i];
+        MeshTree &tree = *meshTrees[i];
+        if (tree.triangles.size() != (mesh.indices.size() + 2) / 3 || tree.shading.size() != tree.triangles.size() ||
+            tree.triangleTexCoords.size() != tree.triangles.size())
+            return false;
+        for (auto &material : tree.materials)
+            material.texDiffuse = mesh.textureDiffuse;
+    }
+    findLights(model, scene);
+    return true;
+}
+
+// World box of an instance is the box around the corners of its mesh's box moved there.
+TwoLevelBVH::BuildInstance TwoLevelBVH::worldBounds(const Instance &instance) const {
+    const MeshTree &tree = *meshTrees[instance.mesh];
+    BuildInstance bounds = {glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX)};
+    // an empty mesh keeps an empty box, which no ray ever enters
+    if (tree.triangles.empty())
+        return bounds;
+    for (int corner = 0; corner < 8; corner++) {
+        const glm::vec3 point((corner & 1 ? tree.maxCoords : tree.minCoords).x,
+                              (corner & 2 ? tree.maxCoords : tree.minCoords).y,
+                              (corner & 4 ? tree.maxCoords : tree.minCoords).z);
+        const glm::vec3 world(instance.toWorld * glm::vec4(point, 1.f));
+        bounds.min = glm::min(bounds.min, world);
+        bounds.max = glm::max(bounds.max, world);
+    }
+    return bounds;
+}
+
+// Instances are rigid, so only their transformations and the top level boxes change and mesh trees stay as built.
+bool TwoLevelBVH::refit(Model &model, Scene &scene) {
+    if (instances.size() != model.instances.size())
+        return false;
+    for (id_t i = 0; i < instances.size(); i++) {
+        if (instances[i].mesh != model.instances[i].mesh)
+            return false;
+    }
+
+    std::vector<BuildInstance> bounds(instances.size());
+    minCoords = glm::vec3(FLT_MAX);
+    maxCoords = glm::vec3(-FLT_MAX);
+    for (id_t i = 0; i < instances.size(); i++) {
+        instances[i].toWorld = model.instances[i].transform;
+        instances[i].toObject = glm::inverse(model.instances[i].transform);
+        bounds[i] = worldBounds(instances[i]);
+        minCoords = glm::min(minCoords, bounds[i].min);
+        maxCoords = glm::max(maxCoords, bounds[i].max);
+    }
+    for (size_t i = nodes.size(); i-- > 0;) {
+        BVHNode &node = nodes[i];
+        if (node.count) {
+            node.min = glm::vec3(FLT_MAX);
+            node.max = glm::vec3(-FLT_MAX);
+            for (id_t j = node.offset; j < node.offset + node.count; j++) {
+                node.min = glm::min(node.min, bounds[leafInstances[j]].min);
+                node.max = glm::max(node.max, bounds[leafInstances[j]].max);
+            }
+        } else {
+            node.min = glm::min(nodes[i + 1].min, nodes[node.offset].min);
+            node.max = glm::max(nodes[i + 1].max, nodes[node.offset].max);
+        }
+    }
+
+    scene.lightTriangles.clear();
+    findLights(model, scene);
+    return true;
+}
+
+// Top level nodes cost a traversal step, an instance in a leaf costs its mesh tree entered through the world box.
+float TwoLevelBVH::sahCost() const {
+    auto surface = [](const glm::vec3 &min, const glm::vec3 &max) {
+        const glm::vec3 extent = glm::max(max - min, glm::vec3(0.f));
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    };
+    if (nodes.empty() || surface(nodes[0].min, nodes[0].max) <= 0.f)
+        return 0.f;
+    float cost = 0.f;
+    for (const BVHNode &node : nodes) {
+        cost += surface(node.min, node.max) * BVH::traversalCost;
+        for (id_t j = node.offset; node.count && j < node.offset + node.count; j++) {
+            const Instance &instance = instances[leafInstances[j]];
+            const BuildInstance bounds = worldBounds(instance);
+            cost += surface(bounds.min, bounds.max) * meshTrees[instance.mesh]->sahCost();
+        }
+    }
+    return cost / surface(nodes[0].min, nodes[0].max);
+}
+
+size_t TwoLevelBVH::triangleCount() const {
+    return instances.empty() ? 0 : instances[instances.size() - 1].firstTriangle +
+                                       meshTrees[instances[instances.size() - 1].mesh]->triangles.size();
+}
+
+const TwoLevelBVH::Instance &TwoLevelBVH::instanceOf(id_t triangle) const {
+    const auto after = [](id_t triangle, const Instance &instance) { return triangle < instance.firstTriangle; };
+    return *(std::upper_bound(instances.begin(), instances.end(), triangle, after) - 1);
+}
+
+Triangle TwoLevelBVH::triangle(id_t id) const {
+    const Instance &instance = instanceOf(id);
+    const Triangle local = meshTrees[instance.mesh]->triangles[id - instance.firstTriangle];
+    return {.posFst = glm::vec3(instance.toWorld * glm::vec4(local.posFst, 1.f)),
+            .posSnd = glm::vec3(instance.toWorld * glm::vec4(local.posSnd, 1.f)),
+            .posTrd = glm::vec3(instance.toWorld * glm::vec4(local.posTrd, 1.f))};
+}
+
+glm::vec3 TwoLevelBVH::normal(id_t id) const {
+    const Instance &instance = instanceOf(id);
+    // the inverse transpose of toWorld
+    const glm::mat3 normalTransform = glm::transpose(glm::mat3(instance.toObject));
+    return transformNormal(normalTransform, meshTrees[instance.mesh]->normal(id - instance.firstTriangle));
+}
+
+const Material &TwoLevelBVH::material(id_t id) const {
+    const Instance &instance = instanceOf(id);
+    return meshTrees[instance.mesh]->material(id - instance.firstTriangle);
+}
+
+TriangleTexCoords TwoLevelBVH::texCoords(id_t id) const {
+    const Instance &instance = instanceOf(id);
+    return meshTrees[instance.mesh]->texCoords(id - instance.firstTriangle);
+}
+
+// Splits instances at the median of their centres along the longest axis, they are few compared to triangles.
+id_t TwoLevelBVH::build(std::vector<BuildInstance> &bounds, size_t begin, size_t end, unsigned depth) {
+    const id_t index = nodes.size();
+    nodes.push_back({});
+    glm::vec3 min(FLT_MAX), max(-FLT_MAX), centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+    for (size_t i = begin; i < end; i++) {
+        const BuildInstance &instance = bounds[leafInstances[i]];
+        min = glm::min(min, instance.min);
+        max = glm::max(max, instance.max);
+        centroidMin = glm::min(centroidMin, 0.5f * (instance.min + instance.max));
+        centroidMax = glm::max(centroidMax, 0.5f * (instance.min + instance.max));
+    }
+    nodes[index].min = min;
+    nodes[index].max = max;
+
+    const id_t count = end - begin;
+    if (count <= maxLeafSize || depth == 0) {
+        nodes[index].offset = begin;
+        nodes[index].count = count;
+        return index;
+    }
+
+    const glm::vec3 extent = centroidMax - centroidMin;
+    const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    const size_t middle = begin + count / 2;
+    std::nth_element(leafInstances.begin() + begin, leafInstances.begin() + middle, leafInstances.begin() + end,
+                     [&](id_t a, id_t b) {
+                         return bounds[a].min[axis] + bounds[a].max[axis] < bounds[b].min[axis] + bounds[b].max[axis];
+                     });
+
+    nodes[index].count = 0;
+    build(bounds, begin, middle, depth - 1);
+    const id_t right = build(bounds, middle, end, depth - 1);
+    nodes[index].offset = right;
+    return index;
+}
+
+/* Front to back traversal of the top level tree, the same as BVH::traverse. For every leaf reached leafTest(leaf)
+ * is called, returning true stops the traversal. tmax is read again after every leaf. */
+template <typename LeafTest>
+bool TwoLevelBVH::traverse(const Ray &ray, const float &tmax, LeafTest leafTest) {
+    auto enter = [&](const BVHNode &node) {
+        const glm::vec3 t0 = (node.min - ray.origin) * ray.invDir;
+        const glm::vec3 t1 = (node.max - ray.origin) * ray.invDir;
+        const glm::vec3 tsmall = glm::min(t0, t1);
+        const glm::vec3 tbig = glm::max(t0, t1);
+        const float tnear = std::max(std::max(tsmall.x, tsmall.y), std::max(tsmall.z, ray.tnear));
+        const float tfar = std::min(std::min(tbig.x, tbig.y), std::min(tbig.z, tmax));
+        return tnear <= tfar ? tnear : FLT_MAX;
+    };
+
+    id_t stack[stackSize];
+    unsigned stackTop = 0;
+    id_t index = 0;
+    if (nodes.empty() || enter(nodes[0]) == FLT_MAX)
+        index = id_t(-1);
+
+    while (index != id_t(-1)) {
+        const BVHNode &node = nodes[index];
+        if (node.count) {
+            if (leafTest(node))
+                return true;
+            index = stackTop ? stack[--stackTop] : id_t(-1);
+            continue;
+        }
+
+        id_t near = index + 1;
+        id_t far = node.offset;
+        float tnear = enter(nodes[near]);
+        float tfar = enter(nodes[far]);
+        if (tfar < tnear) {
+            std::swap(near, far);
+            std::swap(tnear, tfar);
+        }
+        if (tnear == FLT_MAX)
+            index = stackTop ? stack[--stackTop] : id_t(-1);
+        else {
+            if (tfar != FLT_MAX)
+                stack[stackTop++] = far;
+            index = near;
+        }
+    }
+    return false;
+}
+
+// The direction is moved without normalizing, so distances along the ray are the same in both spaces and the
+// closest hit so far limits the search in every following instance.
+static Ray objectRay(const TwoLevelBVH::Instance &instance, const Ray &ray) {
+    return Ray(glm::vec3(instance.toObject * glm::vec4(ray.origin, 1.f)), glm::mat3(instance.toObject) * ray.dir,
+               ray.tnear, ray.tfar);
+}
+
+bool TwoLevelBVH::intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) {
+    Stats::add(Stats::Rays, 1);
+    bool found = false;
+    distance = ray.tfar;
+    auto closestHit = [&](const BVHNode &leaf) {
+        for (id_t i = leaf.offset; i < leaf.offset + leaf.count; i++) {
+            const Instance &instance = instances[leafInstances[i]];
+            id_t meshTriangle;
+            if (meshTrees[instance.mesh]->closestHit(objectRay(instance, ray), meshTriangle, baryPosition, distance)) {
+                found = true;
+                triangle = instance.firstTriangle + meshTriangle;
+            }
+        }
+        return false;
+    };
+    traverse(ray, distance, closestHit);
+    return found;
+}
+
+bool TwoLevelBVH::intersectShadowRay(const Ray &ray, const id_t lightTriangle) {
+    Stats::add(Stats::ShadowRays, 1);
+    auto anyHit = [&](const BVHNode &leaf) {
+        for (id_t i = leaf.offset; i < leaf.offset + leaf.count; i++) {
+            const Instance &instance = instances[leafInstances[i]];
+            const id_t meshCount = meshTrees[instance.mesh]->triangles.size();
+            const id_t meshLight = lightTriangle - instance.firstTriangle < meshCount
+                                       ? lightTriangle - instance.firstTriangle
+                                       : id_t(-1);
+            if (meshTrees[instance.mesh]->anyHit(objectRay(instance, ray), meshLight))
+                return true;
+        }
+        return false;
+    };
+    return traverse(ray, ray.tfar, anyHit);
+}
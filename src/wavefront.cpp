@@ -0,0 +1,133 @@
+#include "wavefront.hpp"
+#include "prng.hpp"
+#include "rayTracer.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+
+static_assert(Wavefront::queueSize >= Wavefront::tileSide * Wavefront::tileSide,
+              "a queue is expected to hold a sample of every pixel of a tile");
+
+Wavefront::Wavefront(Accelerator &accelerator, Scene &scene) : accelerator(accelerator), scene(scene) {
+    paths.origin.resize(queueSize);
+    paths.dir.resize(queueSize);
+    paths.throughput.resize(queueSize);
+    paths.radiance.resize(queueSize);
+    paths.pixel.resize(queueSize);
+    paths.depth.resize(queueSize);
+    paths.triangle.resize(queueSize);
+    paths.baryPosition.resize(queueSize);
+    paths.alive.resize(queueSize);
+    shadowRays.ray.resize(queueSize);
+    shadowRays.light.resize(queueSize);
+    shadowRays.contribution.resize(queueSize);
+    shadowRays.path.resize(queueSize);
+}
+
+void Wavefront::renderTile(const glm::vec3 &eye, const glm::vec3 &leftUpper, const glm::vec3 &dx,
+                           const glm::vec3 &dy, unsigned tx, unsigned ty, glm::vec3 *colors) {
+    std::fill(colors, colors + tileSide * tileSide, glm::vec3(0.f));
+    const unsigned batch = queueSize / (tileSide * tileSide);
+    for (unsigned done = 0; done < scene.samples; done += batch) {
+        generate(eye, leftUpper, dx, dy, tx, ty, std::min(batch, scene.samples - done));
+        while (pathCount) {
+            extend();
+            shade();
+            traceShadows();
+            compact(colors);
+        }
+    }
+}
+
+// Paths start at the eye, through a random point of their pixel.
+void Wavefront::generate(const glm::vec3 &eye, const glm::vec3 &leftUpper, const glm::vec3 &dx, const glm::vec3 &dy,
+                         unsigned tx, unsigned ty, unsigned samples) {
+    pathCount = 0;
+    for (unsigned y = ty; y < std::min(ty + tileSide, scene.yres); y++) {
+        for (unsigned x = tx; x < std::min(tx + tileSide, scene.xres); x++) {
+            for (unsigned s = 0; s < samples; s++) {
+                paths.origin[pathCount] = eye;
+                paths.dir[pathCount] = leftUpper + (x + PRNG::uniformFloat(0.f, 1.f)) * dx +
+                                       (y + PRNG::uniformFloat(0.f, 1.f)) * dy;
+                paths.throughput[pathCount] = glm::vec3(1.f);
+                paths.radiance[pathCount] = glm::vec3(0.f);
+                paths.pixel[pathCount] = (y - ty) * tileSide + (x - tx);
+                paths.depth[pathCount] = 1;
+                pathCount++;
+            }
+        }
+    }
+}
+
+void Wavefront::extend() {
+    for (size_t i = 0; i < pathCount; i++) {
+        float distance;
+        paths.alive[i] = accelerator.intersectRay(Ray(paths.origin[i], paths.dir[i]), paths.triangle[i],
+                                                  paths.baryPosition[i], distance);
+    }
+}
+
+// Misses take the background, hits queue their shadow ray and bounce, as RayTracer::shade does for one path.
+void Wavefront::shade() {
+    shadowCount = 0;
+    for (size_t i = 0; i < pathCount; i++) {
+        glm::vec3 &throughput = paths.throughput[i];
+        if (!paths.alive[i]) {
+            paths.radiance[i] += throughput * scene.background;
+            Stats::addPath(paths.depth[i] - 1);
+            continue;
+        }
+
+        glm::vec3 intersection, normal;
+        BRDF material;
+        accelerator.surfaceAt(paths.triangle[i], paths.baryPosition[i], intersection, normal, material);
+        const glm::vec3 wo = glm::normalize(paths.origin[i] - intersection);
+        // nonzero only when primary ray had hit the light surface
+        if (paths.depth[i] == 1)
+            paths.radiance[i] += material.radiance() * std::max(0.f, glm::dot(wo, normal));
+
+        glm::vec3 contribution;
+        if (RayTracer::sampleLight(accelerator, scene, wo, intersection, normal, material,
+                                   shadowRays.ray[shadowCount], shadowRays.light[shadowCount], contribution)) {
+            shadowRays.contribution[shadowCount] = throughput * contribution;
+            shadowRays.path[shadowCount] = i;
+            shadowCount++;
+        }
+
+        glm::vec3 wi;
+        if (RayTracer::bounce(scene, material, wo, normal, paths.depth[i], throughput, wi)) {
+            paths.origin[i] = intersection + 0.001f * normal;
+            paths.dir[i] = wi;
+            paths.depth[i]++;
+        } else {
+            paths.alive[i] = false;
+            Stats::addPath(paths.depth[i]);
+        }
+    }
+}
+
+void Wavefront::traceShadows() {
+    for (size_t i = 0; i < shadowCount; i++) {
+        if (!accelerator.intersectShadowRay(shadowRays.ray[i], shadowRays.light[i]))
+            paths.radiance[shadowRays.path[i]] += shadowRays.contribution[i];
+    }
+}
+
+// Finished paths leave their light in their pixels, the others move to the front keeping their order.
+void Wavefront::compact(glm::vec3 *colors) {
+    size_t kept = 0;
+    for (size_t i = 0; i < pathCount; i++) {
+        if (!paths.alive[i]) {
+            colors[paths.pixel[i]] += paths.radiance[i];
+            continue;
+        }
+        paths.origin[kept] = paths.origin[i];
+        paths.dir[kept] = paths.dir[i];
+        paths.throughput[kept] = paths.throughput[i];
+        paths.radiance[kept] = paths.radiance[i];
+        paths.pixel[kept] = paths.pixel[i];
+        paths.depth[kept] = paths.depth[i];
+        kept++;
+    }
+    pathCount = kept;
+}
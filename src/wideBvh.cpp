@@ -0,0 +1,418 @@
+#include "wideBvh.hpp"
+#include "cacheFile.hpp"
+#include "scene.hpp"
+#include "simd.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+static float surface(const glm::vec3 &min, const glm::vec3 &max) {
+    const glm::vec3 extent = max - min;
+    return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+}
+
+// 2^exponent, built from its bits as the traversal does it for every node
+static float step(int exponent) {
+    const uint32_t bits = uint32_t(exponent + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+template <unsigned N> WideBVH<N>::WideBVH(Model &model, Scene &scene) : BVH(model, scene) {
+    collapseTree();
+    if (scene.compressedNodes)
+        compressTree();
+}
+
+template <unsigned N> WideBVH<N>::WideBVH(const Mesh &mesh, Scene &scene) : BVH(mesh, scene) {
+    collapseTree();
+    if (scene.compressedNodes)
+        compressTree();
+}
+
+template <unsigned N>
+WideBVH<N>::WideBVH(const Accelerator &source, const std::vector<id_t> &ids, Scene &scene) : BVH(source, ids, scene) {
+    collapseTree();
+    if (scene.compressedNodes)
+        compressTree();
+}
+
+template <unsigned N> void WideBVH<N>::collapseTree() {
+    if (!nodes.empty()) {
+        wideNodes.reserve(nodes.size() / (N - 1) + 1);
+        collapse(0);
+    }
+    // the binary tree is not used anymore
+    nodes.clear();
+}
+
+/* Node by node, the same indices stay valid. Leaf triangles get 16 bit ids too when their blocks allow it. */
+template <unsigned N> void WideBVH<N>::compressTree() {
+    for (const WideNode &node : wideNodes) {
+        for (unsigned slot = 0; slot < N; slot++) {
+            if (node.count[slot] > UINT16_MAX) {
+                std::cout << "A leaf of " << node.count[slot] << " triangles does not fit compressed nodes\n";
+                return;
+            }
+        }
+    }
+
+    compressedNodes.resize(wideNodes.size(), {});
+    for (size_t i = 0; i < wideNodes.size(); i++) {
+        const WideNode &node = wideNodes[i];
+        glm::vec3 min[N], max[N];
+        for (unsigned slot = 0; slot < N; slot++) {
+            for (id_t axis = 0; axis < 3; axis++) {
+                min[slot][axis] = node.bounds[0][axis][slot];
+                max[slot][axis] = node.bounds[1][axis][slot];
+            }
+            compressedNodes[i].child[slot] = node.child[slot];
+            compressedNodes[i].count[slot] = node.count[slot];
+        }
+        quantize(compressedNodes[i], min, max);
+    }
+    wideNodes.clear();
+    if (!blocks.compactLanes())
+        std::cout << "Triangle ids of some blocks are too far apart for 16 bits, keeping them whole\n";
+}
+
+/* The grid starts at the minimum of the used slots and the step is the smallest power of two that reaches their
+ * maximum in 255 steps, so decoding is exact apart from the final addition. Quantized bounds are checked against the
+ * decoded values and moved outwards until they enclose the box, rounding cannot make a child smaller. */
+template <unsigned N> void WideBVH<N>::quantize(CompressedNode &node, const glm::vec3 *min, const glm::vec3 *max) {
+    glm::vec3 nodeMin(FLT_MAX), nodeMax(-FLT_MAX);
+    for (unsigned slot = 0; slot < N; slot++) {
+        if (node.child[slot] != id_t(-1)) {
+            nodeMin = glm::min(nodeMin, min[slot]);
+            nodeMax = glm::max(nodeMax, max[slot]);
+        }
+    }
+    if (nodeMin.x > nodeMax.x)
+        nodeMin = nodeMax = glm::vec3(0.f);
+
+    for (id_t axis = 0; axis < 3; axis++) {
+        const float origin = nodeMin[axis];
+        // smallest power of two at least extent / 255, the finest normal one for a flat box
+        int exponent = -126;
+        const float extent = (nodeMax[axis] - origin) / 255.f;
+        if (extent > 0.f)
+            exponent = std::max(std::frexp(extent, &exponent) == 0.5f ? exponent - 1 : exponent, -126);
+        // unused slots decode above the maximum, so it is kept strictly below the end of the grid
+        while (origin + 255.f * step(exponent) <= nodeMax[axis])
+            exponent++;
+        node.origin[axis] = origin;
+        node.exponent[axis] = exponent;
+
+        const float s = step(exponent);
+        for (unsigned slot = 0; slot < N; slot++) {
+            // an empty box, lower bound at the end of the grid and upper one at its start
+            if (node.child[slot] == id_t(-1)) {
+                node.bounds[0][axis][slot] = 255;
+                node.bounds[1][axis][slot] = 0;
+                continue;
+            }
+            int lo = std::min(std::max(int(std::floor((min[slot][axis] - origin) / s)), 0), 255);
+            while (lo > 0 && origin + float(lo) * s > min[slot][axis])
+                lo--;
+            int hi = std::min(std::max(int(std::ceil((max[slot][axis] - origin) / s)), 0), 255);
+            while (hi < 255 && origin + float(hi) * s < max[slot][axis])
+                hi++;
+            node.bounds[0][axis][slot] = lo;
+            node.bounds[1][axis][slot] = hi;
+        }
+    }
+}
+
+template <unsigned N>
+void WideBVH<N>::slotBounds(const CompressedNode &node, unsigned slot, glm::vec3 &min, glm::vec3 &max) {
+    for (id_t axis = 0; axis < 3; axis++) {
+        const float s = step(node.exponent[axis]);
+        min[axis] = node.origin[axis] + float(node.bounds[0][axis][slot]) * s;
+        max[axis] = node.origin[axis] + float(node.bounds[1][axis][slot]) * s;
+    }
+}
+
+template <unsigned N> WideBVH<N>::WideBVH(Scene &scene) : BVH(scene) {}
+
+template <unsigned N> size_t WideBVH<N>::memoryUsage() {
+    return wideNodes.size() * sizeof(WideNode) + compressedNodes.size() * sizeof(CompressedNode) +
+           blocks.memoryUsage();
+}
+
+template <unsigned N> void WideBVH<N>::serialize(CacheFile &cache) {
+    Accelerator::serialize(cache);
+    cache.array(wideNodes);
+    cache.array(compressedNodes);
+}
+
+// Parents are pushed before their children, so going backwards every inner child is fitted before its slot.
+template <unsigned N> void WideBVH<N>::refitNodes() {
+    // compressed children are quantized again from the decoded boxes of theirs
+    for (size_t i = compressedNodes.size(); i-- > 0;) {
+        CompressedNode &node = compressedNodes[i];
+        glm::vec3 min[N], max[N];
+        for (unsigned slot = 0; slot < N; slot++) {
+            min[slot] = glm::vec3(FLT_MAX);
+            max[slot] = glm::vec3(-FLT_MAX);
+            if (node.child[slot] == id_t(-1))
+                continue;
+            if (node.count[slot])
+                blocks.bounds(triangles, node.child[slot], node.count[slot], min[slot], max[slot]);
+            else {
+                const CompressedNode &child = compressedNodes[node.child[slot]];
+                for (unsigned j = 0; j < N; j++) {
+                    if (child.child[j] == id_t(-1))
+                        continue;
+                    glm::vec3 childMin, childMax;
+                    slotBounds(child, j, childMin, childMax);
+                    min[slot] = glm::min(min[slot], childMin);
+                    max[slot] = glm::max(max[slot], childMax);
+                }
+            }
+        }
+        quantize(node, min, max);
+    }
+
+    for (size_t i = wideNodes.size(); i-- > 0;) {
+        WideNode &node = wideNodes[i];
+        for (unsigned slot = 0; slot < N; slot++) {
+            if (node.child[slot] == id_t(-1))
+                continue;
+            glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+            if (node.count[slot])
+                blocks.bounds(triangles, node.child[slot], node.count[slot], min, max);
+            else {
+                const WideNode &child = wideNodes[node.child[slot]];
+                for (unsigned j = 0; j < N; j++) {
+                    for (id_t axis = 0; axis < 3; axis++) {
+                        min[axis] = std::min(min[axis], child.bounds[0][axis][j]);
+                        max[axis] = std::max(max[axis], child.bounds[1][axis][j]);
+                    }
+                }
+            }
+            for (id_t axis = 0; axis < 3; axis++) {
+                node.bounds[0][axis][slot] = min[axis];
+                node.bounds[1][axis][slot] = max[axis];
+            }
+        }
+    }
+}
+
+// As for the binary tree, a node costs one traversal step however many children it tests at once.
+template <unsigned N> float WideBVH<N>::sahCost() const {
+    float cost = 0.f, rootSurface = 0.f;
+    for (size_t i = 0; i < wideNodes.size(); i++) {
+        const WideNode &node = wideNodes[i];
+        glm::vec3 nodeMin(FLT_MAX), nodeMax(-FLT_MAX);
+        for (unsigned slot = 0; slot < N; slot++) {
+            if (node.child[slot] == id_t(-1))
+                continue;
+            const glm::vec3 min(node.bounds[0][0][slot], node.bounds[0][1][slot], node.bounds[0][2][slot]);
+            const glm::vec3 max(node.bounds[1][0][slot], node.bounds[1][1][slot], node.bounds[1][2][slot]);
+            nodeMin = glm::min(nodeMin, min);
+            nodeMax = glm::max(nodeMax, max);
+            if (node.count[slot])
+                cost += surface(min, max) * intersectionCost * TriangleBlocks::blocksFor(node.count[slot]);
+        }
+        cost += surface(nodeMin, nodeMax) * traversalCost;
+        if (i == 0)
+            rootSurface = surface(nodeMin, nodeMax);
+    }
+    for (size_t i = 0; i < compressedNodes.size(); i++) {
+        const CompressedNode &node = compressedNodes[i];
+        glm::vec3 nodeMin(FLT_MAX), nodeMax(-FLT_MAX);
+        for (unsigned slot = 0; slot < N; slot++) {
+            if (node.child[slot] == id_t(-1))
+                continue;
+            glm::vec3 min, max;
+            slotBounds(node, slot, min, max);
+            nodeMin = glm::min(nodeMin, min);
+            nodeMax = glm::max(nodeMax, max);
+            if (node.count[slot])
+                cost += surface(min, max) * intersectionCost * TriangleBlocks::blocksFor(node.count[slot]);
+        }
+        cost += surface(nodeMin, nodeMax) * traversalCost;
+        if (i == 0)
+            rootSurface = surface(nodeMin, nodeMax);
+    }
+    return rootSurface > 0.f ? cost / rootSurface : 0.f;
+}
+
+/* Turns binary node into a wide one, whose children are found by opening the biggest inner child until
+ * there are N of them. Returns its index in wideNodes. */
+template <unsigned N> id_t WideBVH<N>::collapse(id_t binary) {
+    id_t children[N];
+    unsigned used = 0;
+    if (nodes[binary].count)
+        children[used++] = binary;
+    else {
+        children[used++] = binary + 1;
+        children[used++] = nodes[binary].offset;
+    }
+    while (used < N) {
+        int biggest = -1;
+        float biggestSurface = -1.f;
+        for (unsigned i = 0; i < used; i++) {
+            const BVHNode &node = nodes[children[i]];
+            if (!node.count && surface(node.min, node.max) > biggestSurface) {
+                biggest = i;
+                biggestSurface = surface(node.min, node.max);
+            }
+        }
+        if (biggest < 0)
+            break;
+        const id_t opened = children[biggest];
+        children[biggest] = opened + 1;
+        children[used++] = nodes[opened].offset;
+    }
+
+    const id_t index = wideNodes.size();
+    wideNodes.push_back({});
+    for (unsigned i = 0; i < N; i++) {
+        for (id_t axis = 0; axis < 3; axis++) {
+            wideNodes[index].bounds[0][axis][i] = i < used ? nodes[children[i]].min[axis] : FLT_MAX;
+            wideNodes[index].bounds[1][axis][i] = i < used ? nodes[children[i]].max[axis] : -FLT_MAX;
+        }
+        wideNodes[index].child[i] = id_t(-1);
+        wideNodes[index].count[i] = 0;
+    }
+    for (unsigned i = 0; i < used; i++) {
+        const BVHNode &node = nodes[children[i]];
+        if (node.count) {
+            wideNodes[index].child[i] = node.offset;
+            wideNodes[index].count[i] = node.count;
+        } else {
+            // wideNodes may grow, so it cannot be assigned directly
+            const id_t child = collapse(children[i]);
+            wideNodes[index].child[i] = child;
+        }
+    }
+    return index;
+}
+
+/* Stack based traversal, children are entered nearest first. leafTest(offset, count) is called for every leaf hit,
+ * returning true stops the traversal. tmax is read again after every leaf, so the test may shorten it. */
+template <unsigned N>
+template <typename LeafTest>
+bool WideBVH<N>::traverse(const Ray &ray, const float &tmax, LeafTest leafTest) {
+    if (wideNodes.empty() && compressedNodes.empty())
+        return false;
+
+    vfloat<N> org[3], inv[3];
+    for (id_t axis = 0; axis < 3; axis++) {
+        org[axis] = vfloat<N>::broadcast(ray.origin[axis]);
+        inv[axis] = vfloat<N>::broadcast(ray.invDir[axis]);
+    }
+
+    struct Entry {
+        id_t child;
+        id_t count;
+        float tnear;
+    };
+    Entry stack[stackSize * N];
+    unsigned stackTop = 0;
+    stack[stackTop++] = {0, 0, ray.tnear};
+    uint64_t visits = 0;
+
+    while (stackTop) {
+        const Entry entry = stack[--stackTop];
+        if (entry.tnear > tmax)
+            continue;
+        visits++;
+        if (entry.count) {
+            if (leafTest(entry.child, entry.count)) {
+                Stats::add(Stats::NodeVisits, visits);
+                return true;
+            }
+            continue;
+        }
+
+        // slabs of all children at once, the sign of the direction picks the side of every box entered first
+        vfloat<N> tnear = vfloat<N>::broadcast(ray.tnear);
+        vfloat<N> tfar = vfloat<N>::broadcast(tmax);
+        const id_t *children, *counts = nullptr;
+        const uint16_t *shortCounts = nullptr;
+        if (compressedNodes.empty()) {
+            const WideNode &node = wideNodes[entry.child];
+            for (id_t axis = 0; axis < 3; axis++) {
+                const vfloat<N> t0 = (vfloat<N>::load(node.bounds[ray.sign[axis]][axis]) - org[axis]) * inv[axis];
+                const vfloat<N> t1 =
+                    (vfloat<N>::load(node.bounds[1 - ray.sign[axis]][axis]) - org[axis]) * inv[axis];
+                tnear = max(t0, tnear);
+                tfar = min(t1, tfar);
+            }
+            children = node.child;
+            counts = node.count;
+        } else {
+            const CompressedNode &node = compressedNodes[entry.child];
+            for (id_t axis = 0; axis < 3; axis++) {
+                const vfloat<N> origin = vfloat<N>::broadcast(node.origin[axis]);
+                const vfloat<N> s = vfloat<N>::broadcast(step(node.exponent[axis]));
+                const vfloat<N> near = vfloat<N>::loadBytes(node.bounds[ray.sign[axis]][axis]);
+                const vfloat<N> far = vfloat<N>::loadBytes(node.bounds[1 - ray.sign[axis]][axis]);
+                const vfloat<N> t0 = (origin + near * s - org[axis]) * inv[axis];
+                const vfloat<N> t1 = (origin + far * s - org[axis]) * inv[axis];
+                tnear = max(t0, tnear);
+                tfar = min(t1, tfar);
+            }
+            children = node.child;
+            shortCounts = node.count;
+        }
+        unsigned hits = lessEqual(tnear, tfar);
+        float distances[N];
+        tnear.store(distances);
+
+        // keep the pushed children sorted, so the nearest one is popped first
+        const unsigned first = stackTop;
+        while (hits) {
+            const unsigned i = __builtin_ctz(hits);
+            hits &= hits - 1;
+            // a flat compressed node may leave its unused slots as thin as a ray can still touch
+            if (children[i] == id_t(-1))
+                continue;
+            unsigned j = stackTop++;
+            for (; j > first && stack[j - 1].tnear < distances[i]; j--)
+                stack[j] = stack[j - 1];
+            stack[j] = {children[i], counts ? counts[i] : shortCounts[i], distances[i]};
+        }
+    }
+    Stats::add(Stats::NodeVisits, visits);
+    return false;
+}
+
+template <unsigned N>
+bool WideBVH<N>::intersectRay(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) {
+    Stats::add(Stats::Rays, 1);
+    distance = ray.tfar;
+    return closestHit(ray, triangle, baryPosition, distance);
+}
+
+template <unsigned N>
+bool WideBVH<N>::closestHit(const Ray &ray, id_t &triangle, glm::vec2 &baryPosition, float &distance) {
+    bool found = false;
+    auto leafTest = [&](id_t offset, id_t count) {
+        found |= blocks.intersectRay(ray, offset, count, triangle, baryPosition, distance);
+        return false;
+    };
+    traverse(ray, distance, leafTest);
+    return found;
+}
+
+template <unsigned N> bool WideBVH<N>::intersectShadowRay(const Ray &ray, const id_t lightTriangle) {
+    Stats::add(Stats::ShadowRays, 1);
+    return anyHit(ray, lightTriangle);
+}
+
+template <unsigned N> bool WideBVH<N>::anyHit(const Ray &ray, const id_t lightTriangle) {
+    auto leafTest = [&](id_t offset, id_t count) {
+        return blocks.intersectShadowRay(ray, offset, count, lightTriangle);
+    };
+    return traverse(ray, ray.tfar, leafTest);
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;